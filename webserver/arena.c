@@ -0,0 +1,69 @@
+/*
+ * arena.c: Bump allocator for per-request memory.
+ *
+ * An allocation only moves the top of the arena, and freeing it does
+ * nothing, until arena_reset() moves the top back to the start. Pointers
+ * within the arena are told apart from malloc'd ones by their address, so
+ * that callers free both the same way.
+ */
+
+#include "common.h"
+#include "arena.h"
+
+/* allocations are aligned to this */
+#define ARENA_ALIGN 16
+
+struct arena {
+	char *base;
+	size_t size;
+	size_t top;			/* bytes handed out since the reset */
+};
+
+struct arena *
+arena_init(size_t size)
+{
+	struct arena *a;
+
+	a = Malloc(sizeof(struct arena));
+	a->base = Malloc_aligned(ARENA_ALIGN, size);
+	a->size = size;
+	a->top = 0;
+	return a;
+}
+
+void
+arena_destroy(struct arena *a)
+{
+	free(a->base);
+	free(a);
+}
+
+/* returns size bytes from a, or from malloc if a has no room or is NULL */
+void *
+arena_alloc(struct arena *a, size_t size)
+{
+	void *ptr;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (!a || size > a->size - a->top)
+		return Malloc(size);
+	ptr = a->base + a->top;
+	a->top += size;
+	return ptr;
+}
+
+/* free ptr, from arena_alloc, unless it is in a. NULL is ignored. */
+void
+arena_free(struct arena *a, void *ptr)
+{
+	if (a && (char *)ptr >= a->base && (char *)ptr < a->base + a->size)
+		return;
+	free(ptr);
+}
+
+/* everything allocated from a since the last reset is done with */
+void
+arena_reset(struct arena *a)
+{
+	a->top = 0;
+}
@@ -0,0 +1,24 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+/*
+ * A bump allocator for memory that lives no longer than one request, owned
+ * by one thread. arena_alloc() carves the arena from the start, and falls
+ * back to malloc when the rest of it is too small, or when a is NULL.
+ * arena_free() frees only what came from malloc, and arena_reset() takes
+ * back the whole arena at once, after the request.
+ *
+ * An arena must only be used by the thread that owns it.
+ */
+
+struct arena;
+
+struct arena *arena_init(size_t size);
+void arena_destroy(struct arena *a);
+void *arena_alloc(struct arena *a, size_t size);
+void arena_free(struct arena *a, void *ptr);
+void arena_reset(struct arena *a);
+
+#endif /* __ARENA_H__ */
@@ -24,6 +24,29 @@ Malloc(size_t size)
 	return rc;
 }
 
+void *
+Realloc(void *ptr, size_t size)
+{
+	void *rc;
+	rc = realloc(ptr, size);
+	if (!rc) {
+		unix_error("realloc");
+	}
+	return rc;
+}
+
+/* size must be a multiple of align */
+void *
+Malloc_aligned(size_t align, size_t size)
+{
+	void *rc;
+	rc = aligned_alloc(align, size);
+	if (!rc) {
+		unix_error("aligned_alloc");
+	}
+	return rc;
+}
+
 /*********************************************************************
  * The Rio package - robust I/O functions
  **********************************************************************/
@@ -267,9 +290,11 @@ open_clientfd(char *hostname, int port)
 	return clientfd;
 }
 
-/* open and return a listening socket on port */
+/* open and return a listening socket on port. with reuseport, any number of
+ * sockets can listen on the port, and the kernel spreads the connections
+ * between them. */
 int
-open_listenfd(int port)
+open_listenfd(int port, int reuseport)
 {
 	int listenfd, optval = 1;
 	struct sockaddr_in serveraddr;
@@ -281,6 +306,12 @@ open_listenfd(int port)
 	SYS(setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
 		       (const void *)&optval, sizeof(int)));
 
+	/* Lets other sockets bind to the port too, and share its
+	   connections. */
+	if (reuseport)
+		SYS(setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+			       (const void *)&optval, sizeof(int)));
+
 	/* Listenfd will be an endpoint for all requests to port
 	   on any IP address for this host */
 	bzero((char *)&serveraddr, sizeof(serveraddr));
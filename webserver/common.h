@@ -20,6 +20,8 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -64,6 +66,8 @@
 
 /* Memory managment wrappers */
 void *Malloc(size_t size);
+void *Realloc(void *ptr, size_t size);
+void *Malloc_aligned(size_t align, size_t size);
 
 /* Persistent state for the robust I/O (Rio) package */
 struct rio;
@@ -76,7 +80,7 @@ ssize_t Rio_readlineb(struct rio *rp, void *usrbuf, size_t maxlen);
 
 /* Wrappers for client/server helper functions */
 int open_clientfd(char *hostname, int port);
-int open_listenfd(int port);
+int open_listenfd(int port, int reuseport);
 
 /* Random functions */
 void init_random();
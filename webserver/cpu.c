@@ -0,0 +1,189 @@
+/*
+ * cpu.c: Pinning threads to CPUs.
+ *
+ * The CPUs are kept in the order they were listed in, so that callers can
+ * hand them out by index. Only CPUs that the process may run on can be
+ * listed. The topology is read from sysfs, and only reported, so that it is
+ * up to whoever picks the list to keep threads that share data on one
+ * package.
+ */
+
+#define _GNU_SOURCE
+#include "common.h"
+#include "cpu.h"
+#include <sched.h>
+
+struct cpus {
+	int nr_cpus;
+	int cpus[CPU_SETSIZE];
+};
+
+/* returns a value from the sysfs topology of cpu, or -1 */
+static int
+cpu_topology(int cpu, const char *name)
+{
+	char path[MAXLINE];
+	FILE *fp;
+	int val = -1;
+
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+	fp = fopen(path, "r");
+	if (fp) {
+		if (fscanf(fp, "%d", &val) != 1)
+			val = -1;
+		fclose(fp);
+	}
+	return val;
+}
+
+/* returns the cpus in list, which are numbers or ranges separated by commas.
+ * exits if the list is malformed or has a cpu we can't run on. */
+struct cpus *
+cpus_init(const char *list)
+{
+	struct cpus *cpus;
+	cpu_set_t allowed;
+	const char *p = list;
+	char *end;
+	long first, last, cpu;
+
+	SYS(sched_getaffinity(0, sizeof(allowed), &allowed));
+	cpus = Malloc(sizeof(struct cpus));
+	cpus->nr_cpus = 0;
+	while (1) {
+		first = last = strtol(p, &end, 10);
+		if (end == p)
+			goto bad;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p)
+				goto bad;
+		}
+		if (first < 0 || last < first || last >= CPU_SETSIZE)
+			goto bad;
+		for (cpu = first; cpu <= last; cpu++) {
+			if (!CPU_ISSET(cpu, &allowed)) {
+				fprintf(stderr, "cpu %ld is not available\n",
+					cpu);
+				exit(1);
+			}
+			if (cpus_find(cpus, cpu) < 0 &&
+			    cpus->nr_cpus < CPU_SETSIZE) {
+				cpus->cpus[cpus->nr_cpus++] = cpu;
+			}
+		}
+		if (*end == '\0')
+			break;
+		if (*end != ',')
+			goto bad;
+		p = end + 1;
+	}
+	return cpus;
+bad:
+	fprintf(stderr, "bad cpu list: %s\n", list);
+	exit(1);
+}
+
+void
+cpus_destroy(struct cpus *cpus)
+{
+	free(cpus);
+}
+
+int
+cpus_count(struct cpus *cpus)
+{
+	return cpus->nr_cpus;
+}
+
+/* returns the i'th cpu in the list */
+int
+cpus_get(struct cpus *cpus, int i)
+{
+	assert(i >= 0 && i < cpus->nr_cpus);
+	return cpus->cpus[i];
+}
+
+/* returns the index of cpu in the list, or -1 */
+int
+cpus_find(struct cpus *cpus, int cpu)
+{
+	int i;
+
+	for (i = 0; i < cpus->nr_cpus; i++) {
+		if (cpus->cpus[i] == cpu)
+			return i;
+	}
+	return -1;
+}
+
+/* print the cpus we may run on, and where the listed ones are */
+void
+cpus_report(struct cpus *cpus)
+{
+	cpu_set_t allowed, packages, cores;
+	int cpu, package, core, i;
+
+	SYS(sched_getaffinity(0, sizeof(allowed), &allowed));
+	CPU_ZERO(&packages);
+	CPU_ZERO(&cores);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &allowed))
+			continue;
+		package = cpu_topology(cpu, "physical_package_id");
+		/* a core is named by its first thread */
+		core = cpu_topology(cpu, "thread_siblings_list");
+		if (package >= 0 && package < CPU_SETSIZE) {
+			CPU_SET(package, &packages);
+		}
+		if (core >= 0 && core < CPU_SETSIZE) {
+			CPU_SET(core, &cores);
+		}
+	}
+	printf("cpus: %d available, on %d packages and %d cores\n",
+	       CPU_COUNT(&allowed), CPU_COUNT(&packages), CPU_COUNT(&cores));
+	for (i = 0; i < cpus->nr_cpus; i++) {
+		cpu = cpus->cpus[i];
+		printf("cpu %d: package %d, core %d\n", cpu,
+		       cpu_topology(cpu, "physical_package_id"),
+		       cpu_topology(cpu, "core_id"));
+	}
+}
+
+/* pin the thread that is created with attr to cpu */
+void
+cpus_attr(pthread_attr_t *attr, int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	SYS(pthread_attr_setaffinity_np(attr, sizeof(set), &set));
+}
+
+/* pin the calling thread to cpu */
+void
+cpus_bind(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	SYS(pthread_setaffinity_np(pthread_self(), sizeof(set), &set));
+}
+
+/* returns the cpu that handled the packets of the socket fd, or -1 */
+int
+cpus_incoming(int fd)
+{
+#ifdef SO_INCOMING_CPU
+	int cpu;
+	socklen_t len = sizeof(cpu);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0)
+		return cpu;
+#endif
+	return -1;
+}
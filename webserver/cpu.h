@@ -0,0 +1,27 @@
+#ifndef __CPU_H__
+#define __CPU_H__
+
+#include <pthread.h>
+
+/*
+ * A list of CPUs that threads are pinned to, parsed from a list like
+ * "0-3,6". cpus_attr() pins a thread that is created with attr, and
+ * cpus_bind() the calling thread. cpus_incoming() returns the CPU that
+ * received the packets of a socket, or -1 if the kernel doesn't say.
+ *
+ * The list is read-only once parsed and may be used concurrently.
+ */
+
+struct cpus;
+
+struct cpus *cpus_init(const char *list);
+void cpus_destroy(struct cpus *cpus);
+int cpus_count(struct cpus *cpus);
+int cpus_get(struct cpus *cpus, int i);
+int cpus_find(struct cpus *cpus, int cpu);
+void cpus_report(struct cpus *cpus);
+void cpus_attr(pthread_attr_t *attr, int cpu);
+void cpus_bind(int cpu);
+int cpus_incoming(int fd);
+
+#endif /* __CPU_H__ */
@@ -0,0 +1,100 @@
+/*
+ * csum.c: Checksums of files, from a fileset index.
+ *
+ * The index starts with the number of files, followed by the name, checksum
+ * and size of each file, one file per line. Names are relative to the
+ * directory the server runs in, like the files it serves. The files are kept
+ * sorted by name and searched with bsearch.
+ */
+
+#include "common.h"
+#include "csum.h"
+
+struct csum_file {
+	char *name;
+	unsigned int csum;
+	int size;
+};
+
+struct csums {
+	int nr_files;
+	struct csum_file *files;
+};
+
+static int
+csum_file_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct csum_file *)a)->name,
+		      ((const struct csum_file *)b)->name);
+}
+
+/* returns the checksums in the index file at path. exits if it can't be
+ * read. */
+struct csums *
+csums_load(const char *path)
+{
+	struct csums *cs;
+	FILE *fp;
+	char name[MAXLINE];
+	int i;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		perror(path);
+		exit(1);
+	}
+	cs = Malloc(sizeof(struct csums));
+	if (fscanf(fp, "%d", &cs->nr_files) != 1 || cs->nr_files < 0) {
+		fprintf(stderr, "%s: bad fileset index\n", path);
+		exit(1);
+	}
+	cs->files = Malloc(sizeof(struct csum_file) * (cs->nr_files + 1));
+	for (i = 0; i < cs->nr_files; i++) {
+		struct csum_file *f = &cs->files[i];
+
+		if (fscanf(fp, "%8191s %u %d", name, &f->csum, &f->size) != 3) {
+			fprintf(stderr, "%s: bad fileset index\n", path);
+			exit(1);
+		}
+		f->name = Malloc(strlen(name) + 1);
+		strcpy(f->name, name);
+	}
+	fclose(fp);
+	qsort(cs->files, cs->nr_files, sizeof(struct csum_file),
+	      csum_file_cmp);
+	return cs;
+}
+
+void
+csums_destroy(struct csums *cs)
+{
+	int i;
+
+	for (i = 0; i < cs->nr_files; i++) {
+		free(cs->files[i].name);
+	}
+	free(cs->files);
+	free(cs);
+}
+
+/* looks up the checksum of file_name, which is only trusted if the file still
+ * has the size it had in the index. returns 1 and fills csum if it is found,
+ * 0 otherwise. */
+int
+csums_find(struct csums *cs, const char *file_name, int file_size,
+	   unsigned int *csum)
+{
+	struct csum_file key, *f;
+
+	/* requested files are named ./path */
+	if (strncmp(file_name, "./", 2) == 0) {
+		file_name += 2;
+	}
+	key.name = (char *)file_name;
+	f = bsearch(&key, cs->files, cs->nr_files, sizeof(struct csum_file),
+		    csum_file_cmp);
+	if (!f || f->size != file_size)
+		return 0;
+	*csum = f->csum;
+	return 1;
+}
@@ -0,0 +1,18 @@
+#ifndef __CSUM_H__
+#define __CSUM_H__
+
+/*
+ * Checksums of files, loaded from the index written by fileset, so that a
+ * file can be sent with its checksum without reading it.
+ *
+ * The table is read-only once loaded and may be searched concurrently.
+ */
+
+struct csums;
+
+struct csums *csums_load(const char *path);
+void csums_destroy(struct csums *cs);
+int csums_find(struct csums *cs, const char *file_name, int file_size,
+	       unsigned int *csum);
+
+#endif /* __CSUM_H__ */
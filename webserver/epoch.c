@@ -0,0 +1,132 @@
+/*
+ * epoch.c: Epoch-based memory reclamation for lock-free readers.
+ *
+ * There is one global epoch. Each thread that reads has a record in which it
+ * announces the epoch it observed when it entered its read-side critical
+ * section. The global epoch can only advance once every active reader has
+ * observed the current epoch. An object unlinked during epoch e can therefore
+ * be freed when the global epoch reaches e + 2: by then, every reader that was
+ * active when the object was unlinked has exited.
+ */
+
+#include "common.h"
+#include "epoch.h"
+
+struct epoch_record {
+	/* (observed epoch << 1) | 1 while in a critical section, 0 otherwise */
+	unsigned long state;
+	int in_use;
+	struct epoch_record *next;
+} __attribute__((aligned(64)));
+
+static unsigned long global_epoch;
+static struct epoch_record *records;
+static pthread_key_t record_key;
+static pthread_once_t record_once = PTHREAD_ONCE_INIT;
+static __thread struct epoch_record *self;
+
+/* a thread exited, let another thread reuse its record */
+static void
+epoch_record_release(void *arg)
+{
+	struct epoch_record *rec = arg;
+
+	__atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void
+epoch_key_init(void)
+{
+	SYS(pthread_key_create(&record_key, epoch_record_release));
+}
+
+/* find or allocate a record for the calling thread. records are never freed,
+ * so readers of the record list need no protection. */
+static struct epoch_record *
+epoch_record_get(void)
+{
+	struct epoch_record *rec;
+
+	pthread_once(&record_once, epoch_key_init);
+	for (rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE); rec;
+	     rec = rec->next) {
+		int unused = 0;
+
+		if (__atomic_compare_exchange_n(&rec->in_use, &unused, 1, 0,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_RELAXED))
+			goto out;
+	}
+	rec = Malloc_aligned(64, sizeof(struct epoch_record));
+	rec->state = 0;
+	rec->in_use = 1;
+	rec->next = __atomic_load_n(&records, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&records, &rec->next, rec, 1,
+					    __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED))
+		;
+out:
+	pthread_setspecific(record_key, rec);
+	return rec;
+}
+
+void
+epoch_enter(void)
+{
+	unsigned long epoch;
+
+	if (!self) {
+		self = epoch_record_get();
+	}
+	epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+	__atomic_store_n(&self->state, (epoch << 1) | 1, __ATOMIC_RELAXED);
+	/* the announcement must be visible before we read shared pointers */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void
+epoch_exit(void)
+{
+	__atomic_store_n(&self->state, 0, __ATOMIC_RELEASE);
+}
+
+/* advance the global epoch if all active readers have observed it. returns
+ * the global epoch. */
+static unsigned long
+epoch_advance(void)
+{
+	unsigned long epoch;
+	struct epoch_record *rec;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+	for (rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE); rec;
+	     rec = rec->next) {
+		unsigned long state;
+
+		state = __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE);
+		if ((state & 1) && (state >> 1) != epoch)
+			return epoch;
+	}
+	if (__atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		epoch++;
+	return epoch;
+}
+
+/* returns the stamp for an object that has just been unlinked */
+unsigned long
+epoch_retire(void)
+{
+	return epoch_advance();
+}
+
+/* returns 1 if an object retired with this stamp can be freed */
+int
+epoch_safe(unsigned long stamp)
+{
+	if (__atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE) >= stamp + 2)
+		return 1;
+	return epoch_advance() >= stamp + 2;
+}
@@ -0,0 +1,18 @@
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+/*
+ * Epoch-based memory reclamation.
+ *
+ * Readers traverse shared data structures without locks between
+ * epoch_enter() and epoch_exit(). A writer that unlinks an object records
+ * epoch_retire() and may free the object once epoch_safe() returns true for
+ * that stamp, when no reader can still hold a reference to it.
+ */
+
+void epoch_enter(void);
+void epoch_exit(void);
+unsigned long epoch_retire(void);
+int epoch_safe(unsigned long stamp);
+
+#endif /* __EPOCH_H__ */
@@ -0,0 +1,264 @@
+/*
+ * queue.c: Bounded multi-producer multi-consumer queue, after Dmitry Vyukov.
+ *
+ * Each cell carries a sequence number that says whose turn it is. A cell at
+ * position pos can be pushed into when its sequence is pos, and popped from
+ * when it is pos + 1. Pushing or popping claims a position by advancing head
+ * or tail with a compare-and-swap, and then hands the cell over by storing
+ * the next sequence, so that threads only contend on the ends and never on a
+ * lock.
+ *
+ * The single-producer single-consumer queue is a plain ring: only the producer
+ * moves head, and only the consumer moves tail, so that publishing an item is
+ * a store, and each side only reads the other's end.
+ *
+ * The eventcount lets threads sleep until the queue changes without a lock
+ * around it. Waiters announce themselves in the low half of a word before
+ * checking the queue a last time, and notifiers bump the epoch in the high
+ * half and wake a futex on it only when there are waiters.
+ */
+
+#include "common.h"
+#include "queue.h"
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+struct queue_cell {
+	unsigned long seq;
+	void *item;
+};
+
+struct queue {
+	unsigned long size;
+	struct queue_cell *cells;
+	/* keep the ends on separate cache lines */
+	unsigned long head __attribute__((aligned(64)));	/* next push */
+	unsigned long tail __attribute__((aligned(64)));	/* next pop */
+} __attribute__((aligned(64)));
+
+/* returns a queue that holds up to size items, and at least 2 */
+struct queue *
+queue_init(unsigned long size)
+{
+	struct queue *q;
+	unsigned long i;
+
+	/* a single cell's sequence can't tell whether it is full or empty */
+	if (size < 2) {
+		size = 2;
+	}
+	q = Malloc_aligned(64, sizeof(struct queue));
+	q->size = size;
+	q->cells = Malloc(sizeof(struct queue_cell) * size);
+	for (i = 0; i < size; i++) {
+		q->cells[i].seq = i;
+		q->cells[i].item = NULL;
+	}
+	q->head = 0;
+	q->tail = 0;
+	return q;
+}
+
+void
+queue_destroy(struct queue *q)
+{
+	free(q->cells);
+	free(q);
+}
+
+/* returns 0 if the queue is full */
+int
+queue_push(struct queue *q, void *item)
+{
+	struct queue_cell *cell;
+	unsigned long pos, seq;
+	long diff;
+
+	pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	while (1) {
+		cell = &q->cells[pos % q->size];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (long)(seq - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1,
+							1, __ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* the cell hasn't been popped since the last lap */
+			return 0;
+		} else {
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+		}
+	}
+	cell->item = item;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* returns the oldest item, or NULL if the queue is empty */
+void *
+queue_pop(struct queue *q)
+{
+	struct queue_cell *cell;
+	unsigned long pos, seq;
+	long diff;
+	void *item;
+
+	pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	while (1) {
+		cell = &q->cells[pos % q->size];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (long)(seq - (pos + 1));
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1,
+							1, __ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* nothing has been pushed into the cell yet */
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+		}
+	}
+	item = cell->item;
+	/* the cell can be pushed into on the next lap */
+	__atomic_store_n(&cell->seq, pos + q->size, __ATOMIC_RELEASE);
+	return item;
+}
+
+struct spsc {
+	unsigned long size;
+	void **items;
+	unsigned long head __attribute__((aligned(64)));	/* next push */
+	unsigned long tail __attribute__((aligned(64)));	/* next pop */
+} __attribute__((aligned(64)));
+
+/* returns a queue that holds up to size items */
+struct spsc *
+spsc_init(unsigned long size)
+{
+	struct spsc *q;
+
+	q = Malloc_aligned(64, sizeof(struct spsc));
+	q->size = size;
+	q->items = Malloc(sizeof(void *) * size);
+	q->head = 0;
+	q->tail = 0;
+	return q;
+}
+
+void
+spsc_destroy(struct spsc *q)
+{
+	free(q->items);
+	free(q);
+}
+
+/* returns 0 if the queue is full */
+int
+spsc_push(struct spsc *q, void *item)
+{
+	unsigned long head = q->head;
+
+	if (head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == q->size)
+		return 0;
+	q->items[head % q->size] = item;
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* returns the oldest item, or NULL if the queue is empty */
+void *
+spsc_pop(struct spsc *q)
+{
+	unsigned long tail = q->tail;
+	void *item;
+
+	if (tail == __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+		return NULL;
+	item = q->items[tail % q->size];
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+	return item;
+}
+
+/* returns about how many items are in the queue */
+unsigned long
+queue_length(struct queue *q)
+{
+	unsigned long head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	unsigned long tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+
+	return head > tail ? head - tail : 0;
+}
+
+void
+eventcount_init(struct eventcount *ev)
+{
+	ev->val = 0;
+}
+
+/* the epoch half of val, which waiters sleep on */
+static unsigned int *
+eventcount_epoch(struct eventcount *ev)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	return (unsigned int *)&ev->val + 1;
+#else
+	return (unsigned int *)&ev->val;
+#endif
+}
+
+/* the caller is about to check whether it needs to wait. returns the key to
+ * wait with. */
+unsigned int
+eventcount_prepare(struct eventcount *ev)
+{
+	return __atomic_fetch_add(&ev->val, 1, __ATOMIC_SEQ_CST) >> 32;
+}
+
+/* the caller doesn't wait after all */
+void
+eventcount_cancel(struct eventcount *ev)
+{
+	__atomic_fetch_sub(&ev->val, 1, __ATOMIC_SEQ_CST);
+}
+
+/* sleep until a notify after the eventcount_prepare that returned key, or for
+ * about timeout ms unless timeout is -1. returns 0 if there was no notify. */
+int
+eventcount_wait(struct eventcount *ev, unsigned int key, int timeout)
+{
+	struct timespec ts, *tsp = NULL;
+	int notified;
+
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000L;
+		tsp = &ts;
+	}
+	while ((__atomic_load_n(&ev->val, __ATOMIC_ACQUIRE) >> 32) == key) {
+		if (syscall(SYS_futex, eventcount_epoch(ev), FUTEX_WAIT_PRIVATE,
+			    key, tsp, NULL, 0) < 0 && errno == ETIMEDOUT)
+			break;
+	}
+	notified = (__atomic_load_n(&ev->val, __ATOMIC_ACQUIRE) >> 32) != key;
+	__atomic_fetch_sub(&ev->val, 1, __ATOMIC_SEQ_CST);
+	return notified;
+}
+
+/* wake up to nr waiters after changing the queue, say one for each item
+ * pushed */
+void
+eventcount_notify(struct eventcount *ev, int nr)
+{
+	/* order the change before checking for waiters, which check the
+	 * queue after announcing themselves */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if ((__atomic_load_n(&ev->val, __ATOMIC_RELAXED) & 0xffffffff) == 0)
+		return;
+	__atomic_fetch_add(&ev->val, 1UL << 32, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, eventcount_epoch(ev), FUTEX_WAKE_PRIVATE,
+		nr, NULL, NULL, 0);
+}
@@ -0,0 +1,48 @@
+#ifndef __QUEUE_H__
+#define __QUEUE_H__
+
+/*
+ * A bounded lock-free queue of pointers, which any number of threads may push
+ * to and pop from concurrently. queue_push() and queue_pop() never block, and
+ * fail when the queue is full or empty.
+ *
+ * Threads that find the queue empty or full wait on an eventcount: they call
+ * eventcount_prepare(), check the queue again, and then either
+ * eventcount_wait() with the key it returned, or eventcount_cancel() if they
+ * don't need to wait after all. Waits can time out. A thread that changes the
+ * queue calls eventcount_notify(), which costs a single load when nobody
+ * waits.
+ */
+
+struct queue;
+
+struct queue *queue_init(unsigned long size);
+void queue_destroy(struct queue *q);
+int queue_push(struct queue *q, void *item);
+void *queue_pop(struct queue *q);
+unsigned long queue_length(struct queue *q);
+
+/*
+ * A bounded queue between one producer and one consumer thread, which costs
+ * no atomic read-modify-write at all. spsc_push() and spsc_pop() fail when
+ * it is full or empty.
+ */
+
+struct spsc;
+
+struct spsc *spsc_init(unsigned long size);
+void spsc_destroy(struct spsc *q);
+int spsc_push(struct spsc *q, void *item);
+void *spsc_pop(struct spsc *q);
+
+struct eventcount {
+	unsigned long val;		/* epoch << 32 | nr of waiters */
+};
+
+void eventcount_init(struct eventcount *ev);
+unsigned int eventcount_prepare(struct eventcount *ev);
+void eventcount_cancel(struct eventcount *ev);
+int eventcount_wait(struct eventcount *ev, unsigned int key, int timeout);
+void eventcount_notify(struct eventcount *ev, int nr);
+
+#endif /* __QUEUE_H__ */
@@ -4,21 +4,208 @@
 
 #include "common.h"
 #include "request.h"
+#include "uring.h"
+#include "queue.h"
+#include "arena.h"
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
+/* bytes buffered per connection, which bounds the size of a request header */
+#define CONN_BUFSIZE 8192
+
+/* seconds a client that is turned away is asked to wait, see conn_shed */
+#define SHED_RETRY_AFTER 1
+
+/* conns that are freed are kept for reuse, up to this many */
+#define POOL_SIZE 256
+/* and requests, up to this many on each thread */
+#define THREAD_REQUESTS 16
+
+/* a part of the request being parsed, at an offset from its start */
+struct slice {
+	int off;
+	int len;
+};
+
+/* where the parser is in the request at the start of a connection's buffer */
+enum parse_state {
+	PARSE_REQUEST_LINE,
+	PARSE_HEADERS,
+	PARSE_DONE,
+	PARSE_ERROR,
+};
+
+/* a client connection, which may carry many requests. requests are read
+ * into buf, which holds the unconsumed bytes from start to end, so that
+ * requests pipelined behind the current one are kept for the next
+ * request_init.
+ *
+ * the request at start is parsed in place, as its bytes arrive. the parser
+ * remembers the line it is in and how far it has scanned, so partial reads
+ * are never scanned twice, and it records where the method, URI and version
+ * are instead of copying them. */
+struct conn {
+	int fd;
+	int keep_alive;	 /* the connection may be kept open */
+	int allocated;	 /* by conn_init, rather than placed by the caller */
+	int start;
+	int end;
+	enum parse_state state;
+	int line;	 /* start of the current line, from start */
+	int scan;	 /* bytes of the request scanned so far */
+	struct slice method;
+	struct slice uri;
+	struct slice version;
+	int connection;	 /* Connection header: 1 keep-alive, -1 close, or 0 */
+	long stamp;	 /* a time kept for the server, see conn_stamp */
+	char buf[CONN_BUFSIZE];
+};
+
+/* the response is put together in a request before it is sent, so that it
+ * can be sent in pieces when the connection is non-blocking. it is iovcnt
+ * pieces of memory starting at iov, followed by the bytes of file from
+ * file_off up to file_size, see request_flush. */
 struct request {
 	int fd;		 /* descriptor for client connection */
+	int http11;	 /* the client speaks HTTP/1.1 */
+	int keep_alive;	 /* keep the connection open after the response */
 	struct file_data *data;
+	struct iovec iov[3];
+	int iovcnt;
+	int file;	 /* file sent after iov, or -1 */
+	off_t file_off;
+	off_t file_size;
+	char buf[MAXBUF]; /* header, or error message */
+	char file_name[MAXLINE]; /* data->file_name, until set_data */
+	struct request *next;	 /* in the free list of a thread */
 };
 
-/* requestError(fd, filename, "404", "Not found", 
+/* conns are freed and allocated again on different threads, so the ones kept
+ * for reuse are shared by all threads */
+static struct queue *conn_pool;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+/* a request is freed on the thread that served it, so each thread keeps its
+ * own for reuse, without atomics. they are freed when the thread exits. */
+struct request_list {
+	struct request *head;
+	int nr;
+};
+
+static __thread struct request_list free_requests;
+static pthread_key_t request_key;
+
+static void
+request_list_free(void *arg)
+{
+	struct request_list *list = arg;
+	struct request *rq;
+
+	while ((rq = list->head)) {
+		list->head = rq->next;
+		free(rq);
+	}
+	list->nr = 0;
+}
+
+static void
+pool_init(void)
+{
+	conn_pool = queue_init(POOL_SIZE);
+	SYS(pthread_key_create(&request_key, request_list_free));
+}
+
+/* returns size bytes, reused from pool if it has any */
+static void *
+pool_alloc(struct queue **pool, size_t size)
+{
+	void *ptr;
+
+	pthread_once(&pool_once, pool_init);
+	if ((ptr = queue_pop(*pool)))
+		return ptr;
+	return Malloc(size);
+}
+
+/* keep ptr for reuse, unless pool is full */
+static void
+pool_free(struct queue **pool, void *ptr)
+{
+	pthread_once(&pool_once, pool_init);
+	if (!queue_push(*pool, ptr)) {
+		free(ptr);
+	}
+}
+
+static struct request *
+request_alloc(void)
+{
+	struct request *rq = free_requests.head;
+
+	if (!rq)
+		return Malloc(sizeof(struct request));
+	free_requests.head = rq->next;
+	free_requests.nr--;
+	return rq;
+}
+
+/* keep rq for reuse on this thread, unless it keeps enough already */
+static void
+request_free(struct request *rq)
+{
+	if (free_requests.nr == THREAD_REQUESTS) {
+		free(rq);
+		return;
+	}
+	if (!free_requests.head) {
+		/* so that they are freed when the thread exits */
+		pthread_once(&pool_once, pool_init);
+		pthread_setspecific(request_key, &free_requests);
+	}
+	rq->next = free_requests.head;
+	free_requests.head = rq;
+	free_requests.nr++;
+}
+
+/* free the conns kept for reuse, and the requests kept by the calling thread.
+ * no thread may be using them. */
+void
+request_pools_destroy(void)
+{
+	void *ptr;
+
+	pthread_once(&pool_once, pool_init);
+	while ((ptr = queue_pop(conn_pool)))
+		free(ptr);
+	queue_destroy(conn_pool);
+	conn_pool = NULL;
+	request_list_free(&free_requests);
+}
+
+/* returns the Connection header of the response to rq, or NULL if it needs
+ * none */
+static const char *
+request_connection_header(struct request *rq)
+{
+	if (rq->keep_alive)
+		return "Connection: keep-alive\r\n";
+	if (rq->http11)
+		return "Connection: close\r\n";
+	return NULL;
+}
+
+/* requestError(rq, filename, "404", "Not found", 
  *		"OS server could not find this file");
  */
 static void
-request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg)
+request_error(struct request *rq, char *cause, char *errnum, char *shortmsg,
+	      char *longmsg)
 {
-	char buf[MAXLINE], body[MAXBUF];
-	int i;
+	char body[MAXBUF];
+	int i, size;
 	unsigned int csum = 0;
+	const char *connection = request_connection_header(rq);
 
 	/* create the body of the error message */
 	sprintf(body, "<html><title>OS Web Server Error</title>");
@@ -27,46 +214,215 @@ request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg)
 	sprintf(body + strlen(body), "<p>%s: %s</p>\r\n", longmsg, cause);
 	sprintf(body + strlen(body), "</body></html>\r\n");
 
-	/* write out the header information for this response */
-	sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
-
-	sprintf(buf, "Content-Type: text/html\r\n");
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
-
-	sprintf(buf, "Content-Length: %ld\r\n", strlen(body));
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
-
 	/* generate a very trivial checksum */
 	for (i = 0; i < strlen(body); i++) {
 		csum += (unsigned char)(body[i]);
 	}
-	sprintf(buf, "Content-Csum: %u\r\n\r\n", csum);
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
 
-	/* write out the content */
-	Rio_write(fd, body, strlen(body));
-	printf("%s", body);
+	/* the header information for this response, followed by the
+	 * content */
+	size = snprintf(rq->buf, MAXBUF, "HTTP/1.0 %s %s\r\n"
+			"Content-Type: text/html\r\n"
+			"Content-Length: %ld\r\n"
+			"%s"
+			"Content-Csum: %u\r\n\r\n"
+			"%s", errnum, shortmsg, strlen(body),
+			connection ? connection : "", csum, body);
+	if (size >= MAXBUF)
+		size = MAXBUF - 1;
+	printf("%s", rq->buf);
+	rq->iov[0].iov_base = rq->buf;
+	rq->iov[0].iov_len = size;
+	rq->iovcnt = 1;
+}
+
+/* returns the first byte c in [p, end), or end. compares 32 or 16 bytes at a
+ * time, when the CPU can. */
+static const char *
+request_scan(const char *p, const char *end, char c)
+{
+#ifdef __AVX2__
+	__m256i v32 = _mm256_set1_epi8(c);
 
+	for (; end - p >= 32; p += 32) {
+		__m256i b = _mm256_loadu_si256((const __m256i *)p);
+		unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(b, v32));
+
+		if (mask)
+			return p + __builtin_ctz(mask);
+	}
+#endif
+#ifdef __SSE2__
+	__m128i v16 = _mm_set1_epi8(c);
+
+	for (; end - p >= 16; p += 16) {
+		__m128i b = _mm_loadu_si128((const __m128i *)p);
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(b, v16));
+
+		if (mask)
+			return p + __builtin_ctz(mask);
+	}
+#endif
+	for (; p < end; p++) {
+		if (*p == c)
+			return p;
+	}
+	return end;
 }
 
-/* reads and discards everything up to an empty text line */
+/* returns 1 if the comma separated list of tokens in [value, end) has token */
+static int
+request_has_token(const char *value, const char *end, const char *token)
+{
+	int len = strlen(token);
+	const char *next;
+
+	for (; value < end; value = next + 1) {
+		next = request_scan(value, end, ',');
+		while (value < next && (*value == ' ' || *value == '\t'))
+			value++;
+		if (next - value >= len && strncasecmp(value, token, len) == 0 &&
+		    (next - value == len || value[len] == ' ' ||
+		     value[len] == '\t'))
+			return 1;
+	}
+	return 0;
+}
+
+/* parse the request line in [line, end), without its line ending */
+static int
+conn_parse_request_line(struct conn *conn, const char *line, const char *end)
+{
+	const char *req = conn->buf + conn->start;
+	const char *sp1, *sp2;
+
+	sp1 = request_scan(line, end, ' ');
+	if (sp1 == end)
+		return 0;
+	sp2 = request_scan(sp1 + 1, end, ' ');
+	conn->method.off = line - req;
+	conn->method.len = sp1 - line;
+	conn->uri.off = sp1 + 1 - req;
+	conn->uri.len = sp2 - (sp1 + 1);
+	conn->version.off = sp2 == end ? end - req : sp2 + 1 - req;
+	conn->version.len = sp2 == end ? 0 : end - (sp2 + 1);
+	return conn->method.len > 0 && conn->uri.len > 0;
+}
+
+/* parse the header line in [line, end). only Connection matters. */
 static void
-request_read_headers(struct rio *rp)
+conn_parse_header(struct conn *conn, const char *line, const char *end)
 {
-	char buf[MAXLINE];
+	if (end - line < 11 || strncasecmp(line, "Connection:", 11) != 0)
+		return;
+	if (request_has_token(line + 11, end, "close")) {
+		conn->connection = -1;
+	} else if (request_has_token(line + 11, end, "keep-alive")) {
+		conn->connection = 1;
+	}
+}
 
-	Rio_readlineb(rp, buf, MAXLINE);
-	while (strcmp(buf, "\r\n")) {
-		Rio_readlineb(rp, buf, MAXLINE);
+/* parse as much of the request at the start of the buffer as has arrived.
+ * returns 1 once the whole request header is in, 0 if more is needed, and -1
+ * if the request is malformed or too large for the buffer. */
+int
+conn_parse(struct conn *conn)
+{
+	const char *req = conn->buf + conn->start;
+	const char *end = conn->buf + conn->end;
+	const char *line, *eol, *nl;
+
+	while (conn->state == PARSE_REQUEST_LINE ||
+	       conn->state == PARSE_HEADERS) {
+		nl = request_scan(req + conn->scan, end, '\n');
+		if (nl == end) {
+			conn->scan = end - req;
+			if (conn->start == 0 && conn->end == CONN_BUFSIZE) {
+				conn->state = PARSE_ERROR;
+				break;
+			}
+			return 0;
+		}
+		line = req + conn->line;
+		eol = nl > line && nl[-1] == '\r' ? nl - 1 : nl;
+		conn->line = conn->scan = nl + 1 - req;
+		if (conn->state == PARSE_REQUEST_LINE) {
+			/* empty lines before a request are ignored */
+			if (eol == line)
+				continue;
+			conn->state = conn_parse_request_line(conn, line, eol) ?
+				PARSE_HEADERS : PARSE_ERROR;
+		} else if (eol == line) {
+			conn->state = PARSE_DONE;
+		} else {
+			conn_parse_header(conn, line, eol);
+		}
+	}
+	return conn->state == PARSE_DONE ? 1 : -1;
+}
+
+/* read more of the connection into its buffer, making room first by moving
+ * the unconsumed bytes to its start. returns the number of bytes read, 0 at
+ * the end of the connection, and -1 on errors, including EAGAIN on a
+ * non-blocking connection with nothing to read. */
+int
+conn_fill(struct conn *conn)
+{
+	char *space;
+	int len;
+	ssize_t n;
+
+	space = conn_space(conn, &len);
+	if (!space) {
+		errno = ENOBUFS;
+		return -1;
 	}
-	return;
+	do {
+		n = read(conn->fd, space, len);
+	} while (n < 0 && errno == EINTR);
+	if (n > 0) {
+		conn_filled(conn, n);
+	}
+	return n;
+}
+
+/* returns where the next bytes of conn go, and sets *len to the room there,
+ * for callers that read them in themselves. returns NULL if the buffer is
+ * full. */
+char *
+conn_space(struct conn *conn, int *len)
+{
+	if (conn->start > 0) {
+		/* the parser's offsets are from start, so they stay valid */
+		memmove(conn->buf, conn->buf + conn->start,
+			conn->end - conn->start);
+		conn->end -= conn->start;
+		conn->start = 0;
+	}
+	if (conn->end == CONN_BUFSIZE)
+		return NULL;
+	*len = CONN_BUFSIZE - conn->end;
+	return conn->buf + conn->end;
 }
 
+/* n bytes have been read into the space returned by conn_space */
+void
+conn_filled(struct conn *conn, int n)
+{
+	conn->end += n;
+}
+
+/* the request at the start of the buffer has been handled, start parsing the
+ * next one */
+static void
+conn_consume(struct conn *conn)
+{
+	conn->start += conn->line;
+	conn->state = PARSE_REQUEST_LINE;
+	conn->line = 0;
+	conn->scan = 0;
+	conn->connection = 0;
+}
 
 /* Calculates filename from uri. 
  * for this simple server, filename = .uri
@@ -76,9 +432,9 @@ request_read_headers(struct rio *rp)
  *
  * Also, we don't serve files with a .. in the path (see request_readfile). */
 static void
-request_parse_URI(char *uri, char *filename, size_t max)
+request_parse_URI(const char *uri, int len, char *filename, size_t max)
 {
-	snprintf(filename, max, "./%s", uri);
+	snprintf(filename, max, "./%.*s", len, uri);
 }
 
 /* Fills in the filetype given the filename */
@@ -96,58 +452,259 @@ request_get_file_type(char *filename, char *filetype)
 }
 
 /* entry point to this file */
-/* returns a pointer to a request struct, filling rq->fd with connfd,
- * and rq->file_name with the file that is being requested.
- * Returns NULL on failure.
+/* returns a new connection for the client socket connfd. keep_alive allows
+ * the connection to stay open for more requests, when the client asks. */
+struct conn *
+conn_init(int connfd, int keep_alive)
+{
+	struct conn *conn;
+
+	conn = conn_init_at(pool_alloc(&conn_pool, sizeof(struct conn)), connfd,
+			    keep_alive);
+	conn->allocated = 1;
+	return conn;
+}
+
+/* bytes taken by a conn, see conn_init_at */
+size_t
+conn_size(void)
+{
+	return sizeof(struct conn);
+}
+
+/* like conn_init, but the conn is placed in mem, which has conn_size() bytes,
+ * so that callers can keep connections in memory they have set up, e.g. for
+ * io_uring fixed buffers */
+struct conn *
+conn_init_at(void *mem, int connfd, int keep_alive)
+{
+	struct conn *conn = mem;
+
+	conn->fd = connfd;
+	conn->allocated = 0;
+	conn->keep_alive = keep_alive;
+	conn->start = 0;
+	conn->end = 0;
+	conn->state = PARSE_REQUEST_LINE;
+	conn->line = 0;
+	conn->scan = 0;
+	conn->connection = 0;
+	conn->stamp = 0;
+	return conn;
+}
+
+void
+conn_destroy(struct conn *conn)
+{
+	assert(conn);
+	/* close the connection fd */
+	SYS(close(conn->fd));
+	if (conn->allocated)
+		pool_free(&conn_pool, conn);
+}
+
+static char shed_response[512];
+static int shed_size;
+static pthread_once_t shed_once = PTHREAD_ONCE_INIT;
+
+/* put together the response of conn_shed, once for all connections */
+static void
+conn_shed_init(void)
+{
+	const char *body = "<html><title>OS Web Server Error</title>"
+		"<body><p>503: Service Unavailable</p></body></html>\r\n";
+	unsigned int csum = 0;
+	int i;
+
+	for (i = 0; body[i]; i++) {
+		csum += (unsigned char)body[i];
+	}
+	shed_size = snprintf(shed_response, sizeof(shed_response),
+			     "HTTP/1.0 503 Service Unavailable\r\n"
+			     "Content-Type: text/html\r\n"
+			     "Content-Length: %zu\r\n"
+			     "Retry-After: %d\r\n"
+			     "Connection: close\r\n"
+			     "Content-Csum: %u\r\n\r\n"
+			     "%s", strlen(body), SHED_RETRY_AFTER, csum, body);
+}
+
+/* turn conn away with a 503 response when the server is overloaded, without
+ * reading its request or waiting for the client, and destroy it */
+void
+conn_shed(struct conn *conn)
+{
+	pthread_once(&shed_once, conn_shed_init);
+	/* discard what the client sent, so that closing the socket doesn't
+	 * reset the connection before the client has read the response */
+	while (recv(conn->fd, conn->buf, CONN_BUFSIZE, MSG_DONTWAIT) > 0)
+		;
+	send(conn->fd, shed_response, shed_size, MSG_DONTWAIT | MSG_NOSIGNAL);
+	conn_destroy(conn);
+}
+
+int
+conn_fd(struct conn *conn)
+{
+	return conn->fd;
+}
+
+/* returns the URI of the request that conn_parse found, and its length in
+ * len, or NULL if it hasn't found one */
+const char *
+conn_uri(struct conn *conn, int *len)
+{
+	if (conn->state != PARSE_DONE)
+		return NULL;
+	*len = conn->uri.len;
+	return conn->buf + conn->start + conn->uri.off;
+}
+
+/* fills name with the file that the request conn_parse found asks for, as
+ * request_init would. returns 0 if it hasn't found one. */
+int
+conn_file_name(struct conn *conn, char *name, size_t max)
+{
+	const char *uri;
+	int len;
+
+	uri = conn_uri(conn, &len);
+	if (!uri)
+		return 0;
+	request_parse_URI(uri, len, name, max);
+	return 1;
+}
+
+/* the time the server last stamped conn with, e.g. when it was queued */
+long
+conn_stamp(struct conn *conn)
+{
+	return conn->stamp;
+}
+
+void
+conn_set_stamp(struct conn *conn, long stamp)
+{
+	conn->stamp = stamp;
+}
+
+/* returns 1 if the next request on conn has already been received, so that
+ * request_init won't block, or if it is known to be malformed */
+int
+conn_pending(struct conn *conn)
+{
+	return conn_parse(conn) != 0;
+}
+
+/* like conn_pending, but first reads what has already arrived on conn,
+ * without waiting for the rest */
+int
+conn_arrived(struct conn *conn)
+{
+	char *space;
+	int len;
+	ssize_t n;
+
+	if (conn_pending(conn))
+		return 1;
+	space = conn_space(conn, &len);
+	if (!space)
+		return 0;
+	do {
+		n = recv(conn->fd, space, len, MSG_DONTWAIT);
+	} while (n < 0 && errno == EINTR);
+	if (n <= 0)
+		return 0;
+	conn_filled(conn, n);
+	return conn_pending(conn);
+}
+
+/* returns a pointer to a request struct, reading the next request on conn,
+ * and filling rq->file_name with the file that is being requested.
+ * Returns NULL on failure, or when the client has closed the connection.
  */
 struct request *
-request_init(int connfd, struct file_data *data)
+request_init(struct conn *conn, struct file_data *data)
 {
-	char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-	struct rio *rio;
 	struct request *rq;
+	const char *req, *method, *version;
+	int ret;
 
 	assert(data);
-	rq = Malloc(sizeof(struct request));
-	rq->fd = connfd;
+	while ((ret = conn_parse(conn)) == 0) {
+		if (conn_fill(conn) <= 0)
+			return NULL;
+	}
+	rq = request_alloc();
+	rq->fd = conn->fd;
 	rq->data = data;
-	data->file_name = Malloc(MAXLINE);
+	rq->iovcnt = 0;
+	rq->file = -1;
+	data->file_name = rq->file_name;
 	data->file_buf = NULL;
 	data->file_size = 0;
-	rio = Rio_init(rq->fd);
-	Rio_readlineb(rio, buf, MAXLINE);
-	sscanf(buf, "%s %s %s", method, uri, version);
+	data->header = NULL;
+	data->header_size = 0;
+	/* only HTTP/1.1 connections are persistent by default */
+	rq->http11 = 0;
+	rq->keep_alive = 0;
+	if (ret < 0) {
+		request_error(rq, "request", "400", "Bad Request",
+			      "OS Web Server could not parse this");
+		/* the connection is closed after this, so the error goes out
+		 * if it can be sent now */
+		request_flush(rq);
+		request_destroy(rq);
+		return NULL;
+	}
+
+	req = conn->buf + conn->start;
+	method = req + conn->method.off;
+	version = req + conn->version.off;
+	rq->http11 = conn->version.len == 8 &&
+		strncmp(version, "HTTP/1.1", 8) == 0;
+	if (conn->method.len != 3 || strncasecmp(method, "GET", 3)) {
+		char name[MAXLINE];
 
-	// printf("%s %s %s, fd = %d\n", method, uri, version, connfd);
-	if (strcasecmp(method, "GET")) {
-		request_error(rq->fd, method, "501", "Not Implemented",
+		snprintf(name, MAXLINE, "%.*s", conn->method.len, method);
+		request_error(rq, name, "501", "Not Implemented",
 			     "OS Web Server does not implement this method");
-		Rio_destroy(rio);
+		request_flush(rq);
 		request_destroy(rq);
 		return NULL;
 	}
-	request_read_headers(rio);
-	request_parse_URI(uri, data->file_name, MAXLINE);
-	Rio_destroy(rio);
+	if (conn->connection > 0 || (rq->http11 && conn->connection == 0)) {
+		rq->keep_alive = conn->keep_alive;
+	}
+	request_parse_URI(req + conn->uri.off, conn->uri.len, data->file_name,
+			  MAXLINE);
+	conn_consume(conn);
 	return rq;
 }
 
+/* returns 1 if the connection stays open for another request after the
+ * response to rq */
+int
+request_keep_alive(struct request *rq)
+{
+	return rq->keep_alive;
+}
+
 void
 request_destroy(struct request *rq)
 {
 	assert(rq);
-	/* close the connection fd */
-	SYS(close(rq->fd));
-	free(rq);
+	if (rq->file >= 0)
+		SYS(close(rq->file));
+	request_free(rq);
 }
 
-/* read in filename corresponding to request. 
- * Returns 1 on success, and fills rq->file_buf, and rq->file_size.
- * Returns 0 on failure, sends error to client. */
+/* check that filename corresponding to request can be served.
+ * Returns 1 on success, and fills rq->file_size.
+ * Returns 0 on failure, with an error for the client to be sent. */
 int
-request_readfile(struct request *rq)
+request_stat(struct request *rq)
 {
-	int srcfd;
 	struct stat sbuf;
 	struct file_data *data;
 	char *ext;
@@ -159,51 +716,182 @@ request_readfile(struct request *rq)
 	if (data->file_name[0] == '/') {
 		/* this shouldn't really happen because we add a "./" at the
 		 * beginning of the file path */
-		request_error(rq->fd, data->file_name, "404", "Not found",
+		request_error(rq, data->file_name, "404", "Not found",
 			      "OS Web Server doesn't serve files "
 			      "with absolute paths");
 		return 0;
 	}
 	if (strstr(data->file_name, "..") != NULL) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
+		request_error(rq, data->file_name, "404", "Not found",
 			      "OS Web Server doesn't serve files "
 			      "with .. in the path");
 		return 0;
 	}
 	if (((ext = strrchr(data->file_name, '.')) != NULL) && 
 	    ((strcmp(ext, ".c") == 0) || (strcmp(ext, ".h") == 0))) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
+		request_error(rq, data->file_name, "404", "Not found",
 			      "OS Web Server doesn't serve C or header files ");
 		return 0;
 	}
 
 	if (stat(data->file_name, &sbuf) < 0) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
+		request_error(rq, data->file_name, "404", "Not found",
 			      "OS Web Server could not find this file");
 		return 0;
 	}
 	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-		request_error(rq->fd, data->file_name, "403", "Forbidden",
+		request_error(rq, data->file_name, "403", "Forbidden",
 			      "OS Web Server could not read this file");
 		return 0;
 	}
 
 	data->file_size = sbuf.st_size;
+	return 1;
+}
+
+/* the file of rq couldn't be read after request_stat found it, because of
+ * err, e.g. it was removed or cut short meanwhile. puts together an error
+ * response instead. */
+void
+request_fail(struct request *rq, int err)
+{
+	struct file_data *data = rq->data;
+
+	if (err == ENOENT) {
+		request_error(rq, data->file_name, "404", "Not found",
+			      "OS Web Server could not find this file");
+	} else {
+		request_error(rq, data->file_name, "500",
+			      "Internal Server Error",
+			      "OS Web Server could not read this file");
+	}
+}
 
+/* read in the file checked by request_stat into buf, which must hold
+ * rq->file_size bytes. this lets the caller choose where the file goes.
+ * Returns 1 on success.
+ * Returns 0 on failure, with errno set and an error for the client to be
+ * sent. */
+int
+request_read(struct request *rq, char *buf)
+{
+	int srcfd, err = 0;
+	struct file_data *data;
+	ssize_t n = 0;
+	off_t off = 0;
+
+	data = rq->data;
+	assert(data);
+
+	if (data->file_size == 0)
+		return 1;
+	srcfd = open(data->file_name, O_RDONLY, 0);
+	if (srcfd < 0) {
+		err = errno;
+		request_fail(rq, err);
+		errno = err;
+		return 0;
+	}
+	while (off < data->file_size) {
+		n = read(srcfd, buf + off, data->file_size - off);
+		if (n > 0) {
+			off += n;
+		} else if (n == 0 || errno != EINTR) {
+			break;
+		}
+	}
+	/* a file that is shorter than request_stat found is an error too */
+	if (off < data->file_size) {
+		err = n < 0 ? errno : EIO;
+	}
+	/* ask the kernel to stop caching the file */
+	posix_fadvise(srcfd, 0, data->file_size, POSIX_FADV_DONTNEED);
+	SYS(close(srcfd));
+	/* we add this delay to simulate a disk. otherwise, file caching
+	 * doesn't have much benefit because a lot of the time is spent
+	 * in processing (see request_processfile below) and so
+	 * request_readfile does not have much impact. */
+	/* we don't need to add this delay any longer. */
+	/* usleep(1000); */
+	if (err) {
+		request_fail(rq, err);
+		errno = err;
+		return 0;
+	}
+	return 1;
+}
+
+/* like request_read, but the file is opened, read, let go of and closed with
+ * one system call, as a chain of operations on ur, which has a fixed file
+ * slot. returns 0 on failure, like request_read. */
+int
+request_read_uring(struct request *rq, char *buf, struct uring *ur)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct file_data *data;
+	int done = 0, err = 0;
+
+	data = rq->data;
+	assert(data);
+
+	if (data->file_size == 0)
+		return 1;
+	/* the file goes into slot 0, and each operation runs even if the one
+	 * before it failed, so that the slot is always closed */
+	sqe = uring_prep(ur, IORING_OP_OPENAT, AT_FDCWD, data->file_name, 0,
+			 0, 0);
+	sqe->open_flags = O_RDONLY;
+	sqe->file_index = 1;
+	sqe->flags = IOSQE_IO_HARDLINK;
+	sqe = uring_prep(ur, IORING_OP_READ, 0, buf, data->file_size, 0, 1);
+	sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+	sqe = uring_prep(ur, IORING_OP_FADVISE, 0, NULL, data->file_size, 0,
+			 2);
+	sqe->fadvise_advice = POSIX_FADV_DONTNEED;
+	sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+	sqe = uring_prep(ur, IORING_OP_CLOSE, 0, NULL, 0, 0, 3);
+	sqe->file_index = 1;
+	uring_enter(ur, 4, -1);
+	while (done < 4) {
+		if (!(cqe = uring_peek(ur))) {
+			uring_enter(ur, 4 - done, -1);
+			continue;
+		}
+		if (cqe->res < 0 && !err) {
+			err = -cqe->res;
+		} else if (cqe->user_data == 1 && cqe->res < data->file_size &&
+			   !err) {
+			/* the file is shorter than request_stat found */
+			err = EIO;
+		}
+		uring_seen(ur);
+		done++;
+	}
+	if (err) {
+		request_fail(rq, err);
+		errno = err;
+		return 0;
+	}
+	return 1;
+}
+
+/* read in filename corresponding to request, into memory from arena, which
+ * the caller frees with arena_free.
+ * Returns 1 on success, and fills rq->file_buf, and rq->file_size.
+ * Returns 0 on failure, sends error to client. */
+int
+request_readfile(struct request *rq, struct arena *arena)
+{
+	struct file_data *data;
+
+	if (request_stat(rq) == 0)
+		return 0;
+	data = rq->data;
 	if (data->file_size) {
-		SYS(srcfd = open(data->file_name, O_RDONLY, 0));
-		data->file_buf = Malloc(data->file_size);
-		Rio_read(srcfd, data->file_buf, data->file_size);
-		/* ask the kernel to stop caching the file */
-		SYS(posix_fadvise(srcfd, 0, data->file_size, 
-				  POSIX_FADV_DONTNEED));
-		SYS(close(srcfd));
-		/* we add this delay to simulate a disk. otherwise, file caching
-		 * doesn't have much benefit because a lot of the time is spent
-		 * in processing (see request_processfile below) and so
-		 * request_readfile does not have much impact. */
-		/* we don't need to add this delay any longer. */
-		/* usleep(1000); */
+		data->file_buf = arena_alloc(arena, data->file_size);
+		if (!request_read(rq, data->file_buf))
+			return 0;
 	}
 	return 1;
 }
@@ -237,37 +925,279 @@ request_processfile(struct request *rq)
 	}
 }
 
-/* send filename to the fd connection */
-void
-request_sendfile(struct request *rq)
+/* generate a very trivial checksum */
+static unsigned int
+request_checksum(const char *buf, int size)
 {
-	char filetype[MAXLINE], buf[MAXBUF];
 	int i;
 	unsigned int csum = 0;
+
+	for (i = 0; i < size; i++) {
+		csum += (unsigned char)(buf[i]);
+	}
+	return csum;
+}
+
+/* puts together the response header for the file in rq->data, whose checksum
+ * is csum, in buf. the Connection header is left out of a header that will be
+ * sent on other connections too. returns the size of the header. */
+static int
+request_format_header(struct request *rq, unsigned int csum, char *buf,
+		      int shared)
+{
+	const char *connection = shared ? NULL : request_connection_header(rq);
+	char filetype[MAXLINE];
 	struct file_data *data;
-	long size = 0;
+	int size = 0;
 
 	data = rq->data;
 	assert(data);
 
 	request_get_file_type(data->file_name, filetype);
-	/* generate a very trivial checksum */
-	for (i = 0; i < data->file_size; i++) {
-		csum += (unsigned char)(data->file_buf[i]);
-	}
-	/* do some processing */
-	request_processfile(rq);
-	/* put together response */
 	size += sprintf(buf + size, "HTTP/1.0 200 OK\r\n");
 	size += sprintf(buf + size, "Server: OS Web Server\r\n");
 	size += sprintf(buf + size, "Content-Type: %s\r\n", filetype);
 	size += sprintf(buf + size, "Content-Length: %d\r\n", data->file_size);
-	size += sprintf(buf + size, "Content-Csum: %u\r\n\r\n", csum);
+	size += sprintf(buf + size, "Content-Csum: %u\r\n", csum);
+	if (connection) {
+		size += sprintf(buf + size, "%s", connection);
+	}
+	size += sprintf(buf + size, "\r\n");
+	return size;
+}
+
+/* puts together the response for the file in rq->data ahead of time, so that
+ * it can be sent many times with a single write. the header is placed just
+ * before data->file_buf, so there must be REQUEST_HEADER_MAX bytes of room
+ * there. */
+void
+request_prepare(struct request *rq)
+{
+	char buf[MAXBUF];
+	struct file_data *data;
+	unsigned int csum;
+	int size;
+
+	data = rq->data;
+	assert(data);
+
+	csum = request_checksum(data->file_buf, data->file_size);
+	/* do some processing */
+	request_processfile(rq);
+	size = request_format_header(rq, csum, buf, 1);
+	assert(size <= REQUEST_HEADER_MAX);
+	data->header = data->file_buf - size;
+	data->header_size = size;
+	memcpy(data->header, buf, size);
+}
+
+/* put together the response with the file in rq->data, to be sent by
+ * request_flush. the response points into data, which must stay around until
+ * it has been sent. */
+void
+request_sendfile(struct request *rq)
+{
+	struct file_data *data;
+	unsigned int csum;
+	int size;
+	const char *connection;
+
+	data = rq->data;
+	assert(data);
+
+	if (data->header) {
+		connection = request_connection_header(rq);
+		if (!connection) {
+			/* the prepared header and data->file_buf go out
+			 * together */
+			rq->iov[0].iov_base = data->header;
+			rq->iov[0].iov_len = data->header_size +
+				data->file_size;
+			rq->iovcnt = 1;
+			return;
+		}
+		/* the Connection header goes just before the empty line that
+		 * ends the prepared header */
+		rq->iov[0].iov_base = data->header;
+		rq->iov[0].iov_len = data->header_size - 2;
+		rq->iov[1].iov_base = (char *)connection;
+		rq->iov[1].iov_len = strlen(connection);
+		rq->iov[2].iov_base = data->header + data->header_size - 2;
+		rq->iov[2].iov_len = 2 + data->file_size;
+		rq->iovcnt = 3;
+		return;
+	}
+	csum = request_checksum(data->file_buf, data->file_size);
+	/* do some processing */
+	request_processfile(rq);
+	size = request_format_header(rq, csum, rq->buf, 0);
+	rq->iov[0].iov_base = rq->buf;
+	rq->iov[0].iov_len = size;
+	rq->iov[1].iov_base = data->file_buf;
+	rq->iov[1].iov_len = data->file_size;
+	rq->iovcnt = 2;
+}
+
+/* put together the response with the file in rq->data, whose size is known,
+ * so that request_flush sends it straight from the file with sendfile,
+ * without reading it into memory. the checksum is *csum, or if csum is NULL,
+ * it is computed over a mapping of the file. the file is not processed.
+ * Returns 1 on success.
+ * Returns 0 on failure, with errno set and an error for the client to be
+ * sent. */
+int
+request_sendfile_direct(struct request *rq, const unsigned int *csum)
+{
+	struct file_data *data;
+	unsigned int sum = 0;
+	int srcfd, size, err;
+	void *map;
+
+	data = rq->data;
+	assert(data);
+
+	srcfd = open(data->file_name, O_RDONLY, 0);
+	if (srcfd < 0) {
+		err = errno;
+		request_fail(rq, err);
+		errno = err;
+		return 0;
+	}
+	if (csum) {
+		sum = *csum;
+	} else if (data->file_size) {
+		map = mmap(NULL, data->file_size, PROT_READ, MAP_PRIVATE,
+			   srcfd, 0);
+		if (map == MAP_FAILED) {
+			err = errno;
+			SYS(close(srcfd));
+			request_fail(rq, err);
+			errno = err;
+			return 0;
+		}
+		sum = request_checksum(map, data->file_size);
+		SYS(munmap(map, data->file_size));
+	}
+	size = request_format_header(rq, sum, rq->buf, 0);
+	rq->iov[0].iov_base = rq->buf;
+	rq->iov[0].iov_len = size;
+	rq->iovcnt = 1;
+	if (data->file_size == 0) {
+		SYS(close(srcfd));
+		return 1;
+	}
+	rq->file = srcfd;
+	rq->file_off = 0;
+	rq->file_size = data->file_size;
+	return 1;
+}
 
-	Rio_write(rq->fd, buf, strlen(buf));
+/* returns the number of pieces of the response to rq in memory that haven't
+ * been sent, and points *iov at them */
+int
+request_unsent(struct request *rq, struct iovec **iov)
+{
+	*iov = rq->iov;
+	return rq->iovcnt;
+}
 
-	/* writes data->file_buf to the client socket */
-	if (data->file_size > 0) {
-		Rio_write(rq->fd, data->file_buf, data->file_size);
+/* n more bytes of the pieces returned by request_unsent have been sent */
+void
+request_sent(struct request *rq, size_t n)
+{
+	while (rq->iovcnt > 0 && n >= rq->iov[0].iov_len) {
+		n -= rq->iov[0].iov_len;
+		memmove(rq->iov, rq->iov + 1,
+			--rq->iovcnt * sizeof(struct iovec));
+	}
+	if (rq->iovcnt > 0) {
+		rq->iov[0].iov_base = (char *)rq->iov[0].iov_base + n;
+		rq->iov[0].iov_len -= n;
 	}
 }
+
+/* returns the file whose bytes from *off for *len bytes end the response,
+ * once the pieces in memory have been sent, or -1 if there are none left */
+int
+request_unsent_file(struct request *rq, off_t *off, size_t *len)
+{
+	if (rq->file < 0)
+		return -1;
+	*off = rq->file_off;
+	*len = rq->file_size - rq->file_off;
+	return rq->file;
+}
+
+/* n more bytes of the file returned by request_unsent_file have been sent */
+void
+request_sent_file(struct request *rq, size_t n)
+{
+	rq->file_off += n;
+	if (rq->file_off < rq->file_size)
+		return;
+	/* ask the kernel to stop caching the file, as request_read does */
+	SYS(posix_fadvise(rq->file, 0, rq->file_size, POSIX_FADV_DONTNEED));
+	SYS(close(rq->file));
+	rq->file = -1;
+}
+
+/* send what is left of the response to rq, with flags for sendmsg. returns 1
+ * once all of it has been sent, 0 if the connection can't take more for now,
+ * and -1 if it failed. */
+static int
+request_send(struct request *rq, int flags)
+{
+	struct msghdr msg;
+	off_t off;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	while (rq->iovcnt > 0) {
+		msg.msg_iov = rq->iov;
+		msg.msg_iovlen = rq->iovcnt;
+		/* the header goes out in the same segment as the start of
+		 * the file */
+		n = sendmsg(rq->fd, &msg, MSG_NOSIGNAL | flags |
+			    (rq->file >= 0 ? MSG_MORE : 0));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN ? 0 : -1;
+		}
+		request_sent(rq, n);
+	}
+	/* sendfile can't be told not to wait */
+	if (rq->file >= 0 && (flags & MSG_DONTWAIT))
+		return 0;
+	while (rq->file >= 0) {
+		off = rq->file_off;
+		n = sendfile(rq->fd, rq->file, &off,
+			     rq->file_size - rq->file_off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN ? 0 : -1;
+		}
+		if (n == 0)	/* the file shrank */
+			return -1;
+		request_sent_file(rq, n);
+	}
+	return 1;
+}
+
+/* send what is left of the response to rq. returns 1 once all of it has been
+ * sent, 0 if the connection is non-blocking and can't take more for now, and
+ * -1 if the connection failed. */
+int
+request_flush(struct request *rq)
+{
+	return request_send(rq, 0);
+}
+
+/* like request_flush, but only sends what the connection takes without
+ * waiting, even if it is blocking */
+int
+request_flush_nowait(struct request *rq)
+{
+	return request_send(rq, MSG_DONTWAIT);
+}
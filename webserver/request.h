@@ -1,16 +1,60 @@
 #ifndef __REQUEST_H__
 #define __REQUEST_H__
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
 struct file_data {
 	char *file_name; /* name of file being requested */
 	char *file_buf;	 /* file is read into this buffer in memory */
 	int file_size;	 /* file size */
+	char *header;	 /* response header, followed by file_buf, or NULL */
+	int header_size;
 };
 
-struct request *request_init(int connfd, struct file_data *data);
-int request_readfile(struct request *rq);
+/* room for the response header of a file, see request_prepare */
+#define REQUEST_HEADER_MAX 160
+
+/* a client connection, see request.c */
+struct conn;
+struct uring;
+struct arena;
+
+struct conn *conn_init(int connfd, int keep_alive);
+size_t conn_size(void);
+struct conn *conn_init_at(void *mem, int connfd, int keep_alive);
+void conn_destroy(struct conn *conn);
+void conn_shed(struct conn *conn);
+int conn_fd(struct conn *conn);
+long conn_stamp(struct conn *conn);
+void conn_set_stamp(struct conn *conn, long stamp);
+int conn_pending(struct conn *conn);
+int conn_arrived(struct conn *conn);
+int conn_fill(struct conn *conn);
+char *conn_space(struct conn *conn, int *len);
+void conn_filled(struct conn *conn, int n);
+int conn_parse(struct conn *conn);
+const char *conn_uri(struct conn *conn, int *len);
+int conn_file_name(struct conn *conn, char *name, size_t max);
+
+struct request *request_init(struct conn *conn, struct file_data *data);
+int request_keep_alive(struct request *rq);
+int request_stat(struct request *rq);
+int request_read(struct request *rq, char *buf);
+void request_fail(struct request *rq, int err);
+int request_read_uring(struct request *rq, char *buf, struct uring *ur);
+int request_readfile(struct request *rq, struct arena *arena);
+void request_prepare(struct request *rq);
 void request_set_data(struct request *rq, struct file_data *data);
 void request_sendfile(struct request *rq);
+int request_sendfile_direct(struct request *rq, const unsigned int *csum);
+int request_flush(struct request *rq);
+int request_flush_nowait(struct request *rq);
+int request_unsent(struct request *rq, struct iovec **iov);
+void request_sent(struct request *rq, size_t n);
+int request_unsent_file(struct request *rq, off_t *off, size_t *len);
+void request_sent_file(struct request *rq, size_t n);
 void request_destroy(struct request *rq);
+void request_pools_destroy(void);
 
 #endif
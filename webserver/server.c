@@ -1,13 +1,73 @@
+#define _GNU_SOURCE
 #include <malloc.h>
 #include "common.h"
 #include "request.h"
 #include "server_thread.h"
+#include "uring.h"
 
 /* 
  * server.c: A very, very simple web server
  *
  * To run:
- *  server portnum nr_threads max_requests max_cache_size
+ *  server [options] portnum nr_threads max_requests max_cache_size
+ *
+ * Options:
+ *  -a			only cache a file that would evict another file when
+ *			it has been requested more often recently (TinyLFU)
+ *  -b cpus		pin the threads to a list of cpus, like 0-3,6: the
+ *			acceptor to the first, and the workers or event loops
+ *			to the others in turn. connections go to the worker
+ *			on the cpu that received them, if there is one.
+ *  -c index		take the checksums of files sent with -z from a fileset
+ *			index, instead of computing them. implies -z.
+ *  -d sched		order in which workers serve connections whose request
+ *			has been read: fifo (default), lanes (files larger
+ *			than 64KB queue apart, for a quarter of the workers,
+ *			and go to the others after waiting 50 ms) or srpt
+ *			(smallest file first, but a file's place improves as
+ *			it waits). the size comes from the cache, or else from
+ *			stat. ignored with -e, -u and -x
+ *  -e			serve connections from nr_threads (at least one) event
+ *			loops on non-blocking sockets, instead of handing each
+ *			connection to a worker that blocks on it
+ *  -k timeout		keep connections open between requests when clients
+ *			ask, for up to timeout seconds (default 5, 0 to
+ *			close after each request). with -e, connections that
+ *			make no progress for this long are closed, too.
+ *  -l			look up cached files without locking, requires the
+ *			clock policy, which becomes the default
+ *  -m			reserve the cache memory up front, as an arena carved
+ *			into size classes
+ *  -n nr_acceptors	accept connections on nr_acceptors threads, each
+ *			listening on its own socket bound to the port with
+ *			SO_REUSEPORT, so that the kernel spreads new
+ *			connections between them (default 1)
+ *  -p policy		cache replacement policy: lru (default), clock, 2q,
+ *			arc, gdsf or gdsf-bytes (GreedyDual-Size-Frequency,
+ *			favouring the object or the byte hit ratio)
+ *  -q target		shed load once connections wait for workers too long:
+ *			while none waits less than target ms in an interval
+ *			of 100 ms, those that waited longer are sent a 503
+ *			with Retry-After, as are those that find the queues
+ *			full or waited a whole interval. ignored with -e, -u
+ *			and -x
+ *  -s nr_shards	split the cache into nr_shards independently locked
+ *			shards, each caching 1/nr_shards of max_cache_size
+ *  -t max_threads	start nr_threads workers, but start more, up to
+ *			max_threads, while connections wait for a worker, and
+ *			retire them again when they have been idle for a while.
+ *			each worker that is started makes room for another
+ *			max_requests / nr_threads queued connections
+ *  -u			like -e, but the loops run on io_uring, and new
+ *			connections are accepted with one multishot accept.
+ *			falls back to -e when io_uring is not available.
+ *  -x			shared-nothing: like -e, but each event loop is a server
+ *			of its own, with its own listening socket on the port
+ *			and 1/nr_threads of max_cache_size. each file belongs
+ *			to one loop, and a request for it is moved there.
+ *			without io_uring, and -n is ignored.
+ *  -z			send files that won't be cached straight from the file
+ *			with sendfile, without reading them into memory
  *
  * Repeatedly handles HTTP requests sent to this port number. Most of the work
  * is done within routines written in server_thread.c and request.c
@@ -16,8 +76,11 @@
 static void
 usage(char *program)
 {
-	fprintf(stderr, "Usage: %s port nr_threads max_requests "
-		"max_cache_size\n", program);
+	fprintf(stderr, "Usage: %s [-a] [-b cpus] [-c index] [-d sched] [-e] "
+		"[-k timeout] [-l] [-m]\n"
+		"\t[-n nr_acceptors] [-p policy] [-q target] [-s nr_shards]\n"
+		"\t[-t max_threads] [-u] [-x] [-z]\n"
+		"\tport nr_threads max_requests max_cache_size\n", program);
 	exit(1);
 }
 
@@ -52,21 +115,283 @@ close_fifo(void)
 	unlink(fifo);
 }
 
+/* connections handed to the server at once, at most */
+#define ACCEPT_BATCH 64
+/* ms the listening socket is left alone after running out of descriptors, so
+ * that closing connections can free some */
+#define ACCEPT_BACKOFF 100
+
+/* a thread that accepts connections on a listening socket of its own */
+struct acceptor {
+	struct server *sv;
+	pthread_t thread;
+	int listenfd;
+	int exitfd;
+	int uring;		/* accept with io_uring, if it is available */
+};
+
+/* returns a non-blocking listening socket on port */
+static int
+listen_nonblock(int port, int reuseport)
+{
+	int listenfd, flags;
+
+	listenfd = open_listenfd(port, reuseport);
+	SYS(flags = fcntl(listenfd, F_GETFL));
+	SYS(fcntl(listenfd, F_SETFL, flags | O_NONBLOCK));
+	return listenfd;
+}
+
+/* accept up to ACCEPT_BATCH connections into connfds, stopping when there are
+ * no more waiting on the non-blocking listenfd. returns how many, and sets
+ * *full if the process or system ran out of descriptors. */
+static int
+accept_batch(int listenfd, int *connfds, int *full)
+{
+	int n = 0, connfd;
+
+	while (n < ACCEPT_BATCH) {
+		connfd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+		if (connfd >= 0) {
+			connfds[n++] = connfd;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			break;
+		} else if (errno == EMFILE || errno == ENFILE) {
+			*full = 1;
+			break;
+		} else if (errno != ECONNABORTED && errno != EINTR) {
+			perror("accept4");
+			exit(1);
+		}
+	}
+	return n;
+}
+
+/* hand the connections on listenfd to the server until an exit event */
+static void
+accept_poll(struct server *sv, int listenfd, int exitfd)
+{
+	int connfds[ACCEPT_BATCH];
+	int n, full = 0;
+	struct pollfd fds[] = {
+		{exitfd, POLLIN},
+		{listenfd, POLLIN},
+	};
+
+	while (1) {
+		/* wait for either a client to connect or an exit event. after
+		 * running out of descriptors, only wait for an exit event for a
+		 * while, rather than spinning on the connections that can't be
+		 * accepted. */
+		fds[1].fd = full ? -1 : listenfd;
+		fds[1].revents = 0;
+		SYS(poll(fds, 2, full ? ACCEPT_BACKOFF : -1));
+		full = 0;
+		
+		if(fds[0].revents & POLLIN) { /* exit requested */
+			break;
+		}
+
+		if (!(fds[1].revents & POLLIN)) /* the backoff is over */
+			continue;
+		/* drain the backlog, and serve the requests. connfds are the
+		 * socket descriptors the server will use to send data to the
+		 * clients */
+		do {
+			n = accept_batch(listenfd, connfds, &full);
+			server_requests(sv, connfds, n);
+		} while (n == ACCEPT_BATCH);
+	}
+}
+
+/* like accept_poll, but one multishot accept on ur keeps accepting
+ * connections, without a system call for each. returns 0 if the kernel
+ * rejects multishot accept, for the caller to fall back to accept_poll. */
+static int
+accept_uring(struct server *sv, struct uring *ur, int listenfd, int exitfd)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int connfds[ACCEPT_BATCH];
+	int exiting = 0, accepting = 0, full = 0, n;
+
+	sqe = uring_prep(ur, IORING_OP_POLL_ADD, exitfd, NULL, 0, 0, 0);
+	sqe->poll32_events = POLLIN;
+	while (!exiting) {
+		/* out of descriptors, the accept is started again later */
+		if (!accepting && !full) {
+			sqe = uring_prep(ur, IORING_OP_ACCEPT, listenfd, NULL,
+					 0, 0, 1);
+			sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+			accepting = 1;
+		}
+		uring_enter(ur, 1, full ? ACCEPT_BACKOFF : -1);
+		full = 0;
+		n = 0;
+		while ((cqe = uring_peek(ur))) {
+			if (cqe->user_data == 0) { /* exit requested */
+				exiting = 1;
+			} else if (cqe->res == -EINVAL) {
+				uring_seen(ur);
+				server_requests(sv, connfds, n);
+				return 0;
+			} else if (cqe->res == -EMFILE ||
+				   cqe->res == -ENFILE) {
+				full = 1;
+			} else if (cqe->res < 0) {
+				errno = -cqe->res;
+				perror("accept");
+				exit(1);
+			} else {
+				connfds[n++] = cqe->res;
+			}
+			if (n == ACCEPT_BATCH) {
+				server_requests(sv, connfds, n);
+				n = 0;
+			}
+			/* the accept is over, e.g. after an error */
+			if (cqe->user_data == 1 &&
+			    !(cqe->flags & IORING_CQE_F_MORE)) {
+				accepting = 0;
+			}
+			uring_seen(ur);
+		}
+		server_requests(sv, connfds, n);
+	}
+	return 1;
+}
+
+static void *
+acceptor_thread(void *arg)
+{
+	struct acceptor *ac = (struct acceptor *)arg;
+	struct uring *ur;
+	int done = 0;
+
+	if (ac->uring && (ur = uring_init(8))) {
+		done = accept_uring(ac->sv, ur, ac->listenfd, ac->exitfd);
+		uring_destroy(ur);
+	}
+	if (!done) {
+		accept_poll(ac->sv, ac->listenfd, ac->exitfd);
+	}
+	return NULL;
+}
+
 int
 main(int argc, char *argv[])
 {
 	int port, nr_threads, max_requests, max_cache_size;
-	int listenfd, connfd, clientlen;
+	int nr_acceptors = 1;
 	int exitfd;
-	struct sockaddr_in clientaddr;
 	struct server *sv;
+	struct acceptor *acceptors;
+	int n, i;
+	struct server_opts opts = {
+		.nr_shards = 1,
+		.lockfree = 0,
+		.policy = NULL,
+		.admission = 0,
+		.arena = 0,
+		.zerocopy = 0,
+		.csums = NULL,
+		.keep_alive = 5,
+		.event = 0,
+		.uring = 0,
+		.max_threads = 0,
+		.cpus = NULL,
+		.partition = 0,
+		.target = 0,
+	};
+	int c;
 
-	if (argc != 5)
+	while ((c = getopt(argc, argv, "ab:c:d:ek:lmn:p:q:s:t:uxz")) != -1) {
+		switch (c) {
+		case 'a':
+			opts.admission = 1;
+			break;
+		case 'b':
+			opts.cpus = optarg;
+			break;
+		case 'c':
+			opts.csums = optarg;
+			opts.zerocopy = 1;
+			break;
+		case 'd':
+			opts.sched = optarg;
+			break;
+		case 'e':
+			opts.event = 1;
+			break;
+		case 'k':
+			opts.keep_alive = atoi(optarg);
+			if (opts.keep_alive < 0) {
+				fprintf(stderr, "timeout should be >= 0\n");
+				usage(argv[0]);
+			}
+			break;
+		case 'l':
+			opts.lockfree = 1;
+			break;
+		case 'm':
+			opts.arena = 1;
+			break;
+		case 'n':
+			nr_acceptors = atoi(optarg);
+			if (nr_acceptors < 1) {
+				fprintf(stderr, "nr_acceptors should be > 0\n");
+				usage(argv[0]);
+			}
+			break;
+		case 'p':
+			opts.policy = optarg;
+			break;
+		case 'q':
+			opts.target = atoi(optarg);
+			if (opts.target < 1) {
+				fprintf(stderr, "target should be > 0\n");
+				usage(argv[0]);
+			}
+			break;
+		case 's':
+			opts.nr_shards = atoi(optarg);
+			if (opts.nr_shards < 1) {
+				fprintf(stderr, "nr_shards should be > 0\n");
+				usage(argv[0]);
+			}
+			break;
+		case 't':
+			opts.max_threads = atoi(optarg);
+			if (opts.max_threads < 1) {
+				fprintf(stderr, "max_threads should be > 0\n");
+				usage(argv[0]);
+			}
+			break;
+		case 'u':
+			opts.event = 1;
+			opts.uring = 1;
+			break;
+		case 'x':
+			opts.event = 1;
+			opts.partition = 1;
+			break;
+		case 'z':
+			opts.zerocopy = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 4)
 		usage(argv[0]);
-	port = atoi(argv[1]);
-	nr_threads = atoi(argv[2]);
-	max_requests = atoi(argv[3]);
-	max_cache_size = atoi(argv[4]);
+	if (!opts.policy)
+		opts.policy = opts.lockfree ? "clock" : "lru";
+	if (!opts.sched)
+		opts.sched = "fifo";
+	port = atoi(argv[optind]);
+	nr_threads = atoi(argv[optind + 1]);
+	max_requests = atoi(argv[optind + 2]);
+	max_cache_size = atoi(argv[optind + 3]);
 	if (port < 1024) {
 		fprintf(stderr, "port = %d, should be >= 1024\n", port);
 		usage(argv[0]);
@@ -76,32 +401,41 @@ main(int argc, char *argv[])
 		usage(argv[0]);
 	}
 
-	sv = server_init(nr_threads, max_requests, max_cache_size);
+	/* a client that goes away fails the send instead of killing us */
+	signal(SIGPIPE, SIG_IGN);
+	sv = server_init(nr_threads, max_requests, max_cache_size, &opts);
 
-	listenfd = open_listenfd(port);
+	/* all the sockets listen before any connection is accepted, so that
+	 * the kernel spreads the connections between them from the start */
 	exitfd = open_fifo();
+	if ((n = server_listeners(sv)) > 0) {
+		struct pollfd fds = {exitfd, POLLIN};
 
-	struct pollfd fds[] = {
-		{exitfd, POLLIN},
-		{listenfd, POLLIN},
-	};
-	while (1) {
-		/* wait for either a client to connect or an exit event */
-		SYS(poll(fds, 2, -1));
-		
-		if(fds[0].revents & POLLIN) { /* exit requested */
-			break;
+		/* the server accepts connections itself, so just wait for an
+		 * exit event */
+		for (i = 0; i < n; i++) {
+			server_listen(sv, listen_nonblock(port, 1));
 		}
-
-		assert(fds[1].revents & POLLIN); /* connect request arrived */
-		clientlen = sizeof(clientaddr);
-		/* connfd is the socket descriptor the server will use to send
-		 * data to the client */
-		SYS(connfd = accept(listenfd, (struct sockaddr *)&clientaddr,
-				    (socklen_t *) & clientlen));
-
-		/* serve the request */
-		server_request(sv, connfd);
+		SYS(poll(&fds, 1, -1));
+	} else {
+		acceptors = Malloc(sizeof(struct acceptor) * nr_acceptors);
+		for (i = 0; i < nr_acceptors; i++) {
+			acceptors[i].sv = sv;
+			acceptors[i].listenfd = listen_nonblock(port,
+								nr_acceptors > 1);
+			acceptors[i].exitfd = exitfd;
+			acceptors[i].uring = opts.uring;
+		}
+		/* this thread is the first acceptor */
+		for (i = 1; i < nr_acceptors; i++) {
+			SYS(pthread_create(&acceptors[i].thread, NULL,
+					   acceptor_thread, &acceptors[i]));
+		}
+		acceptor_thread(&acceptors[0]);
+		for (i = 1; i < nr_acceptors; i++) {
+			pthread_join(acceptors[i].thread, NULL);
+		}
+		free(acceptors);
 	}
 
 	close_fifo();
@@ -1,400 +1,3730 @@
+#define _GNU_SOURCE
 #include "request.h"
 #include "server_thread.h"
 #include "common.h"
+#include "epoch.h"
+#include "tinylfu.h"
+#include "slab.h"
+#include "csum.h"
+#include "uring.h"
+#include "queue.h"
+#include "cpu.h"
+#include "arena.h"
 #include <pthread.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-// Entry in hash table
-struct node{
-    struct file_data *file;
-    struct node *next;
+/* a cached file. each file has exactly one entry, which is in both its shard's
+ * index and one of the lists of the replacement policy. the entry, the
+ * file name, the response header and the file contents are one allocation, so
+ * that a hit is sent with a single write. entries are immutable
+ * once inserted and are reference counted: the cache holds one reference while
+ * the entry is linked, and each request sending the file holds another, so that
+ * an evicted entry is only freed after the last send from it has finished.
+ *
+ * in lock-free mode, the index is read without the shard lock, and an evicted
+ * entry keeps the cache's reference until no reader can still find it in the
+ * index (see epoch.c).
+ *
+ * a file is read into its entry, and its response header is put together,
+ * before the entry is inserted. meanwhile, the entry is on the shard's loading
+ * list, and requests for the same file wait for the read and share the entry
+ * instead of reading the file again. files that won't be cached get an entry
+ * that is never inserted, for the same reason. */
+struct cache_entry {
+	struct file_data data;		/* the file, data.file_name is name */
+	unsigned long hash;		/* hash of the file name */
+	int size;			/* bytes charged, 0 if never inserted */
+	int loading;			/* file is being read into the entry */
+	int error;			/* errno if the read failed, or 0 */
+	int refcnt;			/* updated atomically */
+	int referenced;			/* accessed since the clock hand passed */
+	int list;			/* policy list that holds the entry */
+	int ghost_hit;			/* the miss found it in a ghost list */
+	int freq;			/* GDSF: accesses while cached */
+	int heap_index;			/* GDSF: position in the shard's heap */
+	double priority;		/* GDSF: eviction order, lowest first */
+	unsigned long retired;		/* epoch stamp, once evicted */
+	struct slab *slab;		/* arena the entry came from, or NULL */
+	struct cache_entry *prev;	/* policy or loading list */
+	struct cache_entry *next;
+	char name[];			/* followed by the header and contents */
 };
 
-// Hash table with cache
-struct hash_table{
-    int cache_space_available;
-    pthread_mutex_t *lock;
-    struct node *LRU_cache;
-    struct node *ht[20101];
+/* a list of cache entries, and the bytes charged for them */
+struct cache_list {
+	struct cache_entry *head;
+	struct cache_entry *tail;
+	int size;
 };
 
-unsigned long hash(char* file_name){
-    int key = 0;
-    for(int i = 0; i < strlen(file_name); i++){
-        key = ((key << 5) + key) + file_name[i];
-    }
+/* a recently evicted file, remembered by policies that adapt to misses on
+ * files they evicted */
+struct ghost {
+	unsigned long hash;
+	int size;
+	struct ghost *hnext;
+	struct ghost *prev;
+	struct ghost *next;
+};
+
+/* ghosts in eviction order, from the oldest (head) to the newest (tail) */
+struct ghost_list {
+	struct ghost *head;
+	struct ghost *tail;
+	long size;			/* sizes of the evicted files */
+	int nr_buckets;
+	struct ghost **ht;
+};
+
+/* an open addressing hash table of cache entries, probed a group of
+ * INDEX_GROUP slots at a time. each slot has a control byte, which is either
+ * CTRL_EMPTY, CTRL_DELETED, or the low 7 bits of the mixed hash of the entry
+ * in the slot, so that a whole group is matched against the hash with a few
+ * SSE2 instructions, and file names are only compared on matching tags.
+ *
+ * slots are only modified under the shard lock, the entry is stored before its
+ * control byte, and a removed slot is cleared after its control byte, so that
+ * lock-free readers see either a matching entry or one they can skip. */
+struct cache_index {
+	unsigned long mask;		/* nr of groups - 1, a power of 2 - 1 */
+	int nr_items;
+	int nr_free;			/* empty slots that may be used up */
+	uint8_t *ctrl;
+	struct cache_entry **slots;
+	unsigned long retired;		/* epoch stamp, once replaced */
+	struct cache_index *next;	/* replaced tables, oldest first */
+};
+
+/* the cache is split into shards, selected by the hash of the file name. each
+ * shard has its own lock, index, policy state and an equal share of the cache
+ * size, so requests for files in different shards don't contend.
+ *
+ * when the index fills up, a new table replaces it, twice the size unless
+ * most of the used slots only held removed entries, and the old table's
+ * entries are moved over a few groups at a time by later inserts, so no
+ * request stalls on rehashing the whole cache. meanwhile, lookups search the
+ * old table, then the new one.
+ *
+ * in lock-free mode, hits don't take the lock, and can only be used with a
+ * policy that doesn't need the lock on hits. evicted entries wait on the limbo
+ * list, in eviction order, until they can be reclaimed.
+ *
+ * with an admission filter, every access is counted in the shard's TinyLFU
+ * sketch. when a new file would need another file to be evicted, it is only
+ * cached if it has been accessed more often recently than that victim. */
+struct cache_shard {
+	pthread_mutex_t lock;
+	int max_size;			/* max bytes charged to the shard */
+	int size;			/* bytes currently charged */
+	int nr_buckets;			/* of the ghost tables */
+	struct cache_index *index;
+	struct cache_index *old_index;	/* being moved into index, or NULL */
+	unsigned long migrated;		/* groups of old_index moved so far */
+	struct cache_index *retired_head; /* replaced tables, see limbo */
+	struct cache_index *retired_tail;
+	struct cache_list list[2];	/* the policy's cached files */
+	struct ghost_list ghost[2];	/* the policy's evicted files */
+	long target;			/* ARC: target size of list[0] */
+	int ghost_hit;			/* file being inserted was a ghost */
+	struct cache_entry **heap;	/* GDSF: min-heap on priority */
+	int heap_nr;
+	int heap_max;
+	double inflation;		/* GDSF: priority of the last victim */
+	int byte_cost;			/* GDSF: cost of a miss is its size */
+	struct cache_entry *limbo_head;
+	struct cache_entry *limbo_tail;
+	struct cache_entry *loading;	/* files being read */
+	pthread_cond_t loaded;		/* a file has been read */
+	struct slab *slab;		/* cache memory arena, or NULL */
+	struct tinylfu *sketch;		/* admission filter, or NULL */
+	long admitted;			/* files that passed the filter */
+	long rejected;			/* files that were turned away */
+} __attribute__((aligned(64)));		/* keep shards on separate cache lines */
+
+/* a cache replacement policy. the hooks are called with the shard lock held,
+ * except that hit is called without it in lock-free mode, which requires
+ * lockless_hit. */
+struct cache_policy {
+	const char *name;
+	int lockless_hit;
+	void (*init)(struct cache_shard *sh);
+	/* a file is about to be inserted, before room is made for it */
+	void (*miss)(struct cache_shard *sh, unsigned long hash);
+	void (*insert)(struct cache_shard *sh, struct cache_entry *e);
+	void (*hit)(struct cache_shard *sh, struct cache_entry *e);
+	/* returns the entry to evict next, without removing it */
+	struct cache_entry *(*victim)(struct cache_shard *sh);
+	/* like victim, but changes nothing, for admission to compare with */
+	struct cache_entry *(*peek)(struct cache_shard *sh);
+	/* e is being evicted */
+	void (*remove)(struct cache_shard *sh, struct cache_entry *e);
+};
+
+/* number of hash buckets of the ghost tables, split between the shards */
+#define CACHE_BUCKETS 20101
+/* the admission sketch of a shard has room for as many files as the shard
+ * can hold when they are this small, which few files are */
+#define SKETCH_FILE_SIZE 4096
+
+/* slots probed at once, the width of an SSE2 register */
+#define INDEX_GROUP 16
+/* control bytes of slots without an entry. tags have the top bit clear. */
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xfe
+/* groups of the old table moved to the new one on each insert */
+#define INDEX_MIGRATE 4
+
+struct cache {
+	int nr_shards;
+	int lockfree;			/* hits don't take the shard lock */
+	const struct cache_policy *policy;
+	struct cache_shard *shards;
+};
+
+/* a keep-alive connection waiting for its next request, indexed by its fd */
+struct idle_conn {
+	struct conn *conn;		/* NULL if the fd isn't waiting */
+	long since;			/* ms, when it started waiting */
+	int prev;			/* fds of the connections that started */
+	int next;			/* waiting before and after it, or -1 */
+};
+
+/* keep-alive connections between requests. a thread waits for them to become
+ * readable with epoll and hands them back to the workers, or closes them
+ * once they have waited for timeout ms. */
+struct idle {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	int epfd;
+	int wakefd;			/* eventfd, wakes up the thread */
+	int timeout;
+	int exiting;
+	int nr_fds;
+	struct idle_conn *conns;
+	int head;			/* the connection waiting the longest */
+	int tail;
+};
+
+/* connections handed to the idle thread by one epoll_wait */
+#define IDLE_EVENTS 64
+
+/* connections a worker takes from a queue at once */
+#define WORKER_BATCH 4
+
+/* a worker thread, and the connections queued for it. a worker that has none
+ * steals from the others. */
+struct worker {
+	struct server *sv;
+	pthread_t thread;
+	int id;
+	struct queue *conns;
+	struct conn *batch[WORKER_BATCH];	/* taken, not yet served */
+	int nr_batch;
+	int next_batch;
+	int active;			/* connections are queued for it */
+	int started;			/* the thread has yet to be joined */
+};
+
+/* the pool of workers grows when a connection waited this long, in ms, */
+#define POOL_GROW_DELAY 10
+/* and shrinks when a worker found nothing to do for this long */
+#define POOL_RETIRE 2000
+
+/* with -q, connections that wait longer than this in ms are always shed, and
+ * the shortest wait in each such interval decides whether shorter waits are */
+#define CODEL_INTERVAL 100
+
+/* workers need little stack, so that a large pool is cheap */
+#define WORKER_STACK (256 * 1024)
+/* files read for a worker without the cache go in its arena, if they fit */
+#define WORKER_ARENA (256 * 1024)
+
+/* with -d, the order in which workers serve connections whose request has
+ * been read */
+enum sched_policy {
+	ORDER_FIFO,			/* the order they were queued in */
+	ORDER_LANES,			/* large files queue apart */
+	ORDER_SRPT,			/* smallest file first */
+};
+
+/* the names of the policies, in the order above */
+static const char *sched_policies[] = { "fifo", "lanes", "srpt" };
+
+#define NR_SCHED_POLICIES \
+	(sizeof(sched_policies) / sizeof(sched_policies[0]))
+
+/* with lanes, files larger than this go in the large lane, which a quarter of
+ * the workers serve first, */
+#define LANE_LARGE (64 * 1024)
+/* and the others once its oldest connection waited this long, in ms */
+#define LANE_STARVE 50
+/* with srpt, a connection gains a place on files this many bytes smaller for
+ * each ms it waits */
+#define SRPT_AGING (64 * 1024)
+
+/* a binary heap of connections, smallest key first */
+struct sched_heap {
+	struct sched_conn {
+		long key;
+		struct conn *conn;
+	} *conns;
+	int nr_conns;
+};
+
+/* connections that were taken from the workers' queues, and whose request has
+ * been read, so that the size of the file it asks for is known */
+struct sched {
+	enum sched_policy policy;
+	pthread_mutex_t lock;
+	struct sched_heap lanes[2];	/* small and large files */
+	int max_conns;			/* in each lane */
+	int nr_conns;			/* in both */
+	int nr_large;			/* workers that serve large files first */
+};
+
+/* a request, and what its response is sent from, which must be kept until the
+ * response has been sent */
+struct reply {
+	struct request *rq;		/* NULL if there is no response */
+	struct file_data data;
+	struct cache_entry *e;		/* pinned entry, or NULL */
+	int held;			/* e isn't pinned, the epoch is held */
+};
+
+/* a connection served by an event loop. as much of a response is sent as the
+ * socket takes, and the rest when the socket becomes writable again.
+ *
+ * with io_uring, the socket stays blocking and the kernel waits for it. the
+ * connection can't go away until the operations on it have completed. */
+struct econn {
+	int fd;				/* until the loop sets up conn */
+	struct conn *conn;
+	struct reply reply;
+	long since;			/* ms, when it last made progress */
+	struct econn *prev;		/* in the loop's list, from the one */
+	struct econn *next;		/* that made progress the longest ago */
+	int inflight;			/* io_uring operations running */
+	int failed;			/* one of them failed */
+	int closing;			/* freed once they have completed */
+	int slot;			/* of conn in the loop's slots, or -1 */
+	int pipe[2];			/* files are spliced through, or -1 */
+	size_t in_pipe;			/* bytes spliced in, not yet out */
+	struct msghdr msg;		/* of the send running */
+};
+
+/* an event loop, which serves its connections either on non-blocking sockets,
+ * as edge-triggered epoll finds them ready, or with io_uring, as operations
+ * on them complete. the main thread hands connections over on the incoming
+ * list.
+ *
+ * with -x, each loop is a server of its own instead: it accepts connections
+ * on its own listening socket, and caches the files that hash to it in its
+ * own cache. a connection that requests another loop's file is moved to that
+ * loop, over the queue from this loop to it, so that loops share nothing but
+ * those queues. */
+struct loop {
+	struct server *sv;
+	pthread_t thread;
+	int epfd;			/* without io_uring */
+	int wakefd;			/* eventfd, new connections or exit */
+	pthread_mutex_t lock;		/* protects incoming and exiting */
+	struct econn *incoming;
+	int exiting;
+	struct econn *head;
+	struct econn *tail;
+	struct uring *ur;		/* for connections, or NULL */
+	struct uring *files;		/* for reading files */
+	char *slots;			/* conns read into as fixed buffers */
+	int *free_slots;
+	int nr_free_slots;
+	uint64_t wake;			/* read from wakefd */
+	int nr_closing;
+	int listenfd;			/* with -x, or -1 */
+	long accept_paused;		/* ran out of descriptors then, or 0 */
+	struct cache *cache;		/* with -x, or NULL */
+	struct spsc **forward;		/* with -x, to each loop, or NULL */
+};
+
+/* connections that can be on their way from one loop to another */
+#define FORWARD_SLOTS 256
+
+/* connections served by an event loop per epoll_wait */
+#define LOOP_EVENTS 64
+/* ms the listening socket of a loop is left alone after running out of
+ * descriptors */
+#define ACCEPT_BACKOFF 100
+
+/* ms a connection of an event loop may make no progress without keep-alive */
+#define LOOP_TIMEOUT 5000
+
+/* io_uring submissions per loop, connections whose buffers are registered with
+ * the kernel, and bytes spliced from a file at a time */
+#define RING_ENTRIES 256
+#define RING_SLOTS 1024
+#define RING_SPLICE 65536
+
+/* operations on a connection, in the low bits of their user_data, which is the
+ * econn. wakeups have a user_data of 0. */
+#define RING_RECV 1
+#define RING_SEND 2
+#define RING_SPLICE_IN 3
+#define RING_SPLICE_OUT 4
+#define RING_OPS 7
+
+/* per-thread counters, summed up when the server exits */
+struct stats {
+	long hits;
+	long misses;
+	long hit_bytes;
+	long miss_bytes;
+	long reads;			/* misses that read the file */
+	long coalesced;			/* misses that waited for a read */
+	long direct;			/* files sent with sendfile */
+	long direct_csums;		/* with the checksum from the index */
+	long requests;
+	long connections;		/* accepted */
+	long timed_out;			/* connections closed when idle */
+	long stalled;			/* sends that waited for the client */
+	long uring_enters;		/* io_uring system calls */
+	long sleeps;			/* workers that found no connection */
+	long steals;			/* connections taken from another worker */
+	long steered;			/* to the cpu that received them */
+	long forwarded;			/* to the loop that owns their file */
+	long shed_late;			/* connections that waited too long */
+	long shed_full;			/* and that found the queues full */
+	long overloaded;		/* intervals that waited above target */
+	long sized;			/* requests whose file was stat'ed */
+	long sized_cached;		/* or found in the cache */
+	long large;			/* in the large lane */
+	long starved;			/* served by a small-lane worker */
+	long full;			/* dispatches that found no room */
+	struct stats *next;
+};
+
+struct server {
+	int nr_threads;
+	int max_requests;
+	int max_cache_size;
+	int exiting;
+	/* add any other parameters you need */
+	struct worker *workers;		/* nr_threads of them, some unused */
+	unsigned int next_worker;	/* gets the next connection */
+	int min_threads;		/* workers that are never retired */
+	int nr_active;			/* workers that are running */
+	int peak_threads;		/* most workers running at once */
+	long started;			/* workers started after server_init */
+	long retired;			/* workers that exited when idle */
+	pthread_mutex_t pool_lock;	/* for the pool of workers */
+	struct cpus *cpus;		/* threads are pinned to, or NULL */
+	int partitioned;		/* loops share nothing, see struct loop */
+	int target;			/* ms, connections may queue, or 0 */
+	long codel_end;			/* ms, when the interval ends */
+	long codel_min;			/* shortest wait in the interval */
+	int overloaded;			/* it was above target last interval */
+	struct sched *sched;		/* NULL if served in fifo order */
+	struct eventcount not_empty;	/* workers wait for connections */
+	struct eventcount not_full;	/* and dispatchers for room */
+	struct cache *cache;
+	int zerocopy;			/* send uncached files with sendfile */
+	struct csums *csums;		/* checksums for sendfile, or NULL */
+	int keep_alive;			/* connections may be kept open */
+	int timeout;			/* ms, idle connections are kept */
+	struct idle *idle;		/* NULL without keep-alive or with loops */
+	struct loop *loops;		/* event loops, or NULL */
+	int nr_loops;
+	unsigned int next_loop;		/* gets the next connection */
+	pthread_mutex_t stats_lock;
+	struct stats *stats;		/* list of all threads' stats */
+};
+
+/* static functions */
+
+/* the arena of the worker that runs in this thread, or NULL */
+static __thread struct arena *thread_arena;
+
+/* initialize file data */
+static void
+file_data_init(struct file_data *data)
+{
+	data->file_name = NULL;
+	data->file_buf = NULL;
+	data->file_size = 0;
+	data->header = NULL;
+	data->header_size = 0;
+}
+
+/* free all file data. the file name belongs to the request. */
+static void
+file_data_free(struct file_data *data)
+{
+	arena_free(thread_arena, data->file_buf);
+	data->file_buf = NULL;
+}
+
+static __thread struct stats *thread_stats;
+/* the ring files are read with, or NULL */
+static __thread struct uring *thread_files;
+/* the cache of the loop that runs in this thread, with -x */
+static __thread struct cache *thread_cache;
+
+/* returns the stats of the calling thread */
+static struct stats *
+stats_get(struct server *sv)
+{
+	if (!thread_stats) {
+		thread_stats = Malloc(sizeof(struct stats));
+		memset(thread_stats, 0, sizeof(struct stats));
+		pthread_mutex_lock(&sv->stats_lock);
+		thread_stats->next = sv->stats;
+		sv->stats = thread_stats;
+		pthread_mutex_unlock(&sv->stats_lock);
+	}
+	return thread_stats;
+}
+
+/* sum up the stats of all threads, and print and free them */
+static void
+stats_print(struct server *sv)
+{
+	struct stats total, *st, *next;
+	struct cache *cache;
+	long admitted = 0, rejected = 0;
+	int i, j;
+
+	memset(&total, 0, sizeof(struct stats));
+	for (st = sv->stats; st; st = next) {
+		next = st->next;
+		total.hits += st->hits;
+		total.misses += st->misses;
+		total.hit_bytes += st->hit_bytes;
+		total.miss_bytes += st->miss_bytes;
+		total.reads += st->reads;
+		total.coalesced += st->coalesced;
+		total.direct += st->direct;
+		total.direct_csums += st->direct_csums;
+		total.requests += st->requests;
+		total.connections += st->connections;
+		total.timed_out += st->timed_out;
+		total.stalled += st->stalled;
+		total.uring_enters += st->uring_enters;
+		total.sleeps += st->sleeps;
+		total.steals += st->steals;
+		total.steered += st->steered;
+		total.forwarded += st->forwarded;
+		total.shed_late += st->shed_late;
+		total.shed_full += st->shed_full;
+		total.overloaded += st->overloaded;
+		total.sized += st->sized;
+		total.sized_cached += st->sized_cached;
+		total.large += st->large;
+		total.starved += st->starved;
+		total.full += st->full;
+		free(st);
+	}
+	sv->stats = NULL;
+	/* with -x, each loop has a cache of its own */
+	cache = sv->partitioned ? sv->loops[0].cache : sv->cache;
+	if (cache && total.hits + total.misses > 0) {
+		printf("cache: %s, %ld hits, %ld misses, hit ratio = %.4f, "
+		       "byte hit ratio = %.4f\n", cache->policy->name,
+		       total.hits, total.misses,
+		       (double)total.hits / (total.hits + total.misses),
+		       (double)total.hit_bytes /
+		       (total.hit_bytes + total.miss_bytes + 1));
+		printf("cache misses: %ld read the file, %ld waited for "
+		       "another read\n", total.reads, total.coalesced);
+	}
+	if (sv->keep_alive || sv->loops) {
+		printf("keep-alive: %ld requests on %ld connections, "
+		       "%ld timed out\n", total.requests, total.connections,
+		       total.timed_out);
+	}
+	if (sv->loops) {
+		printf("event loops: %d, %ld sends waited for the client\n",
+		       sv->nr_loops, total.stalled);
+	}
+	if (sv->partitioned) {
+		printf("shared-nothing: %ld requests moved to the loop that "
+		       "owns their file\n", total.forwarded);
+	}
+	if (sv->nr_threads > 0) {
+		printf("workers: slept %ld times, stole %ld connections, the "
+		       "queues were full %ld times\n", total.sleeps,
+		       total.steals, total.full);
+	}
+	if (sv->target) {
+		printf("shedding: %ld connections waited too long, %ld found "
+		       "the queues full, %ld intervals were overloaded\n",
+		       total.shed_late, total.shed_full, total.overloaded);
+	}
+	if (sv->sched) {
+		printf("scheduling: %s, %ld sizes from the cache and %ld from "
+		       "stat", sched_policies[sv->sched->policy],
+		       total.sized_cached, total.sized);
+		if (sv->sched->policy == ORDER_LANES) {
+			printf(", %ld large files, %ld served by the small "
+			       "lane", total.large, total.starved);
+		}
+		printf("\n");
+	}
+	if (sv->min_threads < sv->nr_threads) {
+		printf("worker pool: %d to %d threads, %ld started and %ld "
+		       "retired, at most %d at once\n", sv->min_threads,
+		       sv->nr_threads, sv->started, sv->retired,
+		       sv->peak_threads);
+	}
+	if (sv->cpus) {
+		printf("cpus: %ld connections handed to the cpu that received "
+		       "them\n", total.steered);
+	}
+	if (total.uring_enters > 0) {
+		printf("io_uring: %ld system calls for %ld requests\n",
+		       total.uring_enters, total.requests);
+	}
+	if (total.direct > 0) {
+		printf("sendfile: %ld files, %ld checksums from the index\n",
+		       total.direct, total.direct_csums);
+	}
+	for (j = 0; j < (sv->partitioned ? sv->nr_loops : 1); j++) {
+		cache = sv->partitioned ? sv->loops[j].cache : sv->cache;
+		for (i = 0; cache && i < cache->nr_shards; i++) {
+			admitted += cache->shards[i].admitted;
+			rejected += cache->shards[i].rejected;
+		}
+	}
+	if (admitted + rejected > 0) {
+		printf("cache admission: %ld admitted, %ld rejected\n",
+		       admitted, rejected);
+	}
+}
+
+/* returns the cpu of worker or loop i, or of the acceptor if i is -1. the
+ * acceptor keeps the first cpu to itself, unless there is only one. */
+static int
+server_cpu(struct server *sv, int i)
+{
+	int n = cpus_count(sv->cpus);
+
+	if (i < 0 || n == 1)
+		return cpus_get(sv->cpus, 0);
+	return cpus_get(sv->cpus, 1 + i % (n - 1));
+}
+
+/* initialize attr for the thread of worker or loop i, see server_cpu */
+static void
+server_attr(struct server *sv, pthread_attr_t *attr, int i)
+{
+	SYS(pthread_attr_init(attr));
+	if (sv->cpus) {
+		cpus_attr(attr, server_cpu(sv, i));
+	}
+}
+
+/* returns the worker or loop, out of n, that the connection on fd goes to
+ * first: the one on the cpu that received it, or else the next in turn */
+static unsigned int
+server_steer(struct server *sv, int fd, unsigned int *next, int n)
+{
+	int i;
+
+	if (sv->cpus && cpus_count(sv->cpus) > 1) {
+		i = cpus_find(sv->cpus, cpus_incoming(fd));
+		if (i > 0 && i <= n) {
+			stats_get(sv)->steered++;
+			return i - 1;
+		}
+	}
+	return __atomic_fetch_add(next, 1, __ATOMIC_RELAXED);
+}
+
+static unsigned long
+cache_hash(const char *file_name)
+{
+	unsigned long key = 5381;
+	const unsigned char *p;
+
+	for (p = (const unsigned char *)file_name; *p; p++) {
+		key = ((key << 5) + key) + *p;
+	}
+	return key;
+}
+
+/* pin a cache entry */
+static void
+cache_get(struct cache_entry *e)
+{
+	__atomic_add_fetch(&e->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+/* unpin a cache entry, freeing it when the last reference is dropped */
+static void
+cache_put(struct cache_entry *e)
+{
+	if (__atomic_sub_fetch(&e->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+		if (e->slab) {
+			slab_free(e->slab, e);
+		} else {
+			free(e);
+		}
+	}
+}
+
+/* append e at the tail of one of the shard's lists */
+static void
+list_append(struct cache_shard *sh, int list, struct cache_entry *e)
+{
+	struct cache_list *l = &sh->list[list];
+
+	e->list = list;
+	e->prev = l->tail;
+	e->next = NULL;
+	if (l->tail) {
+		l->tail->next = e;
+	} else {
+		l->head = e;
+	}
+	l->tail = e;
+	l->size += e->size;
+}
+
+static void
+list_remove(struct cache_shard *sh, struct cache_entry *e)
+{
+	struct cache_list *l = &sh->list[e->list];
+
+	if (e->prev) {
+		e->prev->next = e->next;
+	} else {
+		l->head = e->next;
+	}
+	if (e->next) {
+		e->next->prev = e->prev;
+	} else {
+		l->tail = e->prev;
+	}
+	e->prev = e->next = NULL;
+	l->size -= e->size;
+}
+
+static void
+ghost_init(struct ghost_list *g, int nr_buckets)
+{
+	int i;
+
+	g->head = g->tail = NULL;
+	g->size = 0;
+	g->nr_buckets = nr_buckets;
+	g->ht = Malloc(sizeof(struct ghost *) * nr_buckets);
+	for (i = 0; i < nr_buckets; i++) {
+		g->ht[i] = NULL;
+	}
+}
+
+static void
+ghost_unlink(struct ghost_list *g, struct ghost *gh)
+{
+	struct ghost **pp;
+
+	for (pp = &g->ht[gh->hash % g->nr_buckets]; *pp != gh;
+	     pp = &(*pp)->hnext)
+		;
+	*pp = gh->hnext;
+	if (gh->prev) {
+		gh->prev->next = gh->next;
+	} else {
+		g->head = gh->next;
+	}
+	if (gh->next) {
+		gh->next->prev = gh->prev;
+	} else {
+		g->tail = gh->prev;
+	}
+	g->size -= gh->size;
+	free(gh);
+}
+
+/* forget the oldest ghosts until they add up to at most max_size bytes */
+static void
+ghost_trim(struct ghost_list *g, long max_size)
+{
+	while (g->head && g->size > max_size) {
+		ghost_unlink(g, g->head);
+	}
+}
+
+static void
+ghost_add(struct ghost_list *g, unsigned long hash, int size)
+{
+	struct ghost *gh = Malloc(sizeof(struct ghost));
+
+	gh->hash = hash;
+	gh->size = size;
+	gh->hnext = g->ht[hash % g->nr_buckets];
+	g->ht[hash % g->nr_buckets] = gh;
+	gh->prev = g->tail;
+	gh->next = NULL;
+	if (g->tail) {
+		g->tail->next = gh;
+	} else {
+		g->head = gh;
+	}
+	g->tail = gh;
+	g->size += size;
+}
+
+/* forget the ghost of a file. returns its size, or -1 if there is none. */
+static int
+ghost_remove(struct ghost_list *g, unsigned long hash)
+{
+	struct ghost *gh;
+	int size;
+
+	for (gh = g->ht[hash % g->nr_buckets]; gh; gh = gh->hnext) {
+		if (gh->hash == hash) {
+			size = gh->size;
+			ghost_unlink(g, gh);
+			return size;
+		}
+	}
+	return -1;
+}
+
+static void
+ghost_destroy(struct ghost_list *g)
+{
+	if (!g->ht)
+		return;
+	ghost_trim(g, 0);
+	free(g->ht);
+}
+
+/* LRU: list[0] runs from the least (head) to the most recently used entry */
+
+static void
+lru_insert(struct cache_shard *sh, struct cache_entry *e)
+{
+	list_append(sh, 0, e);
+}
+
+static void
+lru_hit(struct cache_shard *sh, struct cache_entry *e)
+{
+	if (sh->list[0].tail == e)
+		return;
+	list_remove(sh, e);
+	list_append(sh, 0, e);
+}
+
+static struct cache_entry *
+lru_victim(struct cache_shard *sh)
+{
+	return sh->list[0].head;
+}
+
+/* CLOCK: hits only set the entry's referenced bit, so they don't need the
+ * lock. the head of list[0] is the clock hand, and referenced entries at the
+ * head get a second chance at the tail. */
+
+static void
+clock_insert(struct cache_shard *sh, struct cache_entry *e)
+{
+	e->referenced = 0;
+	list_append(sh, 0, e);
+}
+
+static void
+clock_hit(struct cache_shard *sh, struct cache_entry *e)
+{
+	/* avoid dirtying the cache line when the bit is already set */
+	if (!__atomic_load_n(&e->referenced, __ATOMIC_RELAXED))
+		__atomic_store_n(&e->referenced, 1, __ATOMIC_RELAXED);
+}
+
+static struct cache_entry *
+clock_victim(struct cache_shard *sh)
+{
+	struct cache_entry *e = sh->list[0].head;
+
+	while (e && __atomic_load_n(&e->referenced, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&e->referenced, 0, __ATOMIC_RELAXED);
+		list_remove(sh, e);
+		list_append(sh, 0, e);
+		e = sh->list[0].head;
+	}
+	return e;
+}
+
+/* the entry the hand would stop at, without clearing referenced bits. if all
+ * are referenced, the hand goes around once and stops at the head. */
+static struct cache_entry *
+clock_peek(struct cache_shard *sh)
+{
+	struct cache_entry *e;
+
+	for (e = sh->list[0].head; e; e = e->next) {
+		if (!__atomic_load_n(&e->referenced, __ATOMIC_RELAXED))
+			return e;
+	}
+	return sh->list[0].head;
+}
+
+/* 2Q: new files enter the FIFO list[0] (A1in). files that are accessed again
+ * after being evicted from it, while remembered in ghost[0] (A1out), are
+ * promoted to the LRU list[1] (Am). so files that are scanned once only ever
+ * displace other such files. A1in is kept to 1/4, and A1out to 1/2, of the
+ * shard size. */
+
+static void
+twoq_init(struct cache_shard *sh)
+{
+	ghost_init(&sh->ghost[0], sh->nr_buckets);
+}
+
+static void
+twoq_miss(struct cache_shard *sh, unsigned long hash)
+{
+	sh->ghost_hit = (ghost_remove(&sh->ghost[0], hash) >= 0);
+}
+
+static void
+twoq_insert(struct cache_shard *sh, struct cache_entry *e)
+{
+	list_append(sh, sh->ghost_hit ? 1 : 0, e);
+}
+
+static void
+twoq_hit(struct cache_shard *sh, struct cache_entry *e)
+{
+	if (e->list == 0 || sh->list[1].tail == e)
+		return;
+	list_remove(sh, e);
+	list_append(sh, 1, e);
+}
+
+static struct cache_entry *
+twoq_victim(struct cache_shard *sh)
+{
+	struct cache_list *in = &sh->list[0];
+
+	if (in->head && (in->size > sh->max_size / 4 || !sh->list[1].head))
+		return in->head;
+	return sh->list[1].head;
+}
+
+static void
+twoq_remove(struct cache_shard *sh, struct cache_entry *e)
+{
+	if (e->list == 0) {
+		ghost_add(&sh->ghost[0], e->hash, e->size);
+		ghost_trim(&sh->ghost[0], sh->max_size / 2);
+	}
+	list_remove(sh, e);
+}
+
+/* ARC: list[0] (T1) holds files accessed once recently, list[1] (T2) files
+ * accessed at least twice. ghost[0] (B1) and ghost[1] (B2) remember the files
+ * evicted from each. a miss on a file in B1 means T1 should have been larger,
+ * and a miss in B2 that T2 should have been, so the target size of T1 adapts to
+ * the workload. sizes are in bytes rather than in numbers of files. */
+
+static void
+arc_init(struct cache_shard *sh)
+{
+	ghost_init(&sh->ghost[0], sh->nr_buckets);
+	ghost_init(&sh->ghost[1], sh->nr_buckets);
+	sh->target = 0;
+}
+
+static void
+arc_miss(struct cache_shard *sh, unsigned long hash)
+{
+	struct ghost_list *b1 = &sh->ghost[0], *b2 = &sh->ghost[1];
+	long delta;
+	int size;
+
+	sh->ghost_hit = 0;
+	if ((size = ghost_remove(b1, hash)) >= 0) {
+		delta = size;
+		if (b2->size > b1->size + size)
+			delta = size * b2->size / (b1->size + size);
+		sh->target += delta;
+		if (sh->target > sh->max_size)
+			sh->target = sh->max_size;
+		sh->ghost_hit = 1;
+	} else if ((size = ghost_remove(b2, hash)) >= 0) {
+		delta = size;
+		if (b1->size > b2->size + size)
+			delta = size * b1->size / (b2->size + size);
+		sh->target -= delta;
+		if (sh->target < 0)
+			sh->target = 0;
+		sh->ghost_hit = 2;
+	}
+}
+
+static void
+arc_insert(struct cache_shard *sh, struct cache_entry *e)
+{
+	long t1 = sh->list[0].size, t2 = sh->list[1].size;
+
+	list_append(sh, sh->ghost_hit ? 1 : 0, e);
+	/* T1 + B1 <= c, and T1 + T2 + B1 + B2 <= 2c */
+	ghost_trim(&sh->ghost[0], sh->max_size - t1);
+	ghost_trim(&sh->ghost[1], 2L * sh->max_size - t1 - t2 -
+		   sh->ghost[0].size);
+}
+
+static void
+arc_hit(struct cache_shard *sh, struct cache_entry *e)
+{
+	if (sh->list[1].tail == e)
+		return;
+	list_remove(sh, e);
+	list_append(sh, 1, e);
+}
+
+static struct cache_entry *
+arc_victim(struct cache_shard *sh)
+{
+	struct cache_list *t1 = &sh->list[0];
+
+	if (t1->head && (t1->size > sh->target || !sh->list[1].head ||
+			 (sh->ghost_hit == 2 && t1->size == sh->target)))
+		return t1->head;
+	return sh->list[1].head;
+}
+
+static void
+arc_remove(struct cache_shard *sh, struct cache_entry *e)
+{
+	ghost_add(&sh->ghost[e->list], e->hash, e->size);
+	list_remove(sh, e);
+}
+
+/* GDSF (GreedyDual-Size-Frequency): files are evicted in order of priority
+ * L + freq * cost / size, kept in a binary min-heap. L is the priority of the
+ * last file evicted, so the priorities of files that stop being accessed are
+ * overtaken by those of newly inserted files. with a cost of 1 per miss, small
+ * files are favoured, which maximizes the object hit ratio. with a cost equal
+ * to the file size, the priority is L + freq, which favours the byte hit
+ * ratio instead. entries are also kept on list[0], in no particular order. */
+
+static void
+gdsf_heap_set(struct cache_shard *sh, int i, struct cache_entry *e)
+{
+	sh->heap[i] = e;
+	e->heap_index = i;
+}
+
+static void
+gdsf_sift_up(struct cache_shard *sh, int i)
+{
+	struct cache_entry *e = sh->heap[i];
+
+	while (i > 0 && sh->heap[(i - 1) / 2]->priority > e->priority) {
+		gdsf_heap_set(sh, i, sh->heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	gdsf_heap_set(sh, i, e);
+}
+
+static void
+gdsf_sift_down(struct cache_shard *sh, int i)
+{
+	struct cache_entry *e = sh->heap[i];
+
+	while (2 * i + 1 < sh->heap_nr) {
+		int child = 2 * i + 1;
+
+		if (child + 1 < sh->heap_nr &&
+		    sh->heap[child + 1]->priority < sh->heap[child]->priority)
+			child++;
+		if (sh->heap[child]->priority >= e->priority)
+			break;
+		gdsf_heap_set(sh, i, sh->heap[child]);
+		i = child;
+	}
+	gdsf_heap_set(sh, i, e);
+}
+
+static void
+gdsf_prioritize(struct cache_shard *sh, struct cache_entry *e)
+{
+	double cost = sh->byte_cost ? e->size : 1;
+
+	e->priority = sh->inflation + e->freq * cost / e->size;
+}
+
+static void
+gdsf_init(struct cache_shard *sh)
+{
+	sh->heap_max = 64;
+	sh->heap = Malloc(sizeof(struct cache_entry *) * sh->heap_max);
+	sh->heap_nr = 0;
+	sh->inflation = 0;
+	sh->byte_cost = 0;
+}
+
+static void
+gdsf_bytes_init(struct cache_shard *sh)
+{
+	gdsf_init(sh);
+	sh->byte_cost = 1;
+}
+
+static void
+gdsf_insert(struct cache_shard *sh, struct cache_entry *e)
+{
+	if (sh->heap_nr == sh->heap_max) {
+		sh->heap_max *= 2;
+		sh->heap = Realloc(sh->heap, sizeof(struct cache_entry *) *
+				   sh->heap_max);
+	}
+	e->freq = 1;
+	gdsf_prioritize(sh, e);
+	gdsf_heap_set(sh, sh->heap_nr++, e);
+	gdsf_sift_up(sh, e->heap_index);
+	list_append(sh, 0, e);
+}
+
+static void
+gdsf_hit(struct cache_shard *sh, struct cache_entry *e)
+{
+	e->freq++;
+	gdsf_prioritize(sh, e);
+	/* the priority only grows */
+	gdsf_sift_down(sh, e->heap_index);
+}
+
+static struct cache_entry *
+gdsf_victim(struct cache_shard *sh)
+{
+	return sh->heap_nr ? sh->heap[0] : NULL;
+}
+
+static void
+gdsf_remove(struct cache_shard *sh, struct cache_entry *e)
+{
+	int i = e->heap_index;
+
+	sh->inflation = e->priority;
+	sh->heap_nr--;
+	if (i != sh->heap_nr) {
+		gdsf_heap_set(sh, i, sh->heap[sh->heap_nr]);
+		gdsf_sift_down(sh, i);
+		gdsf_sift_up(sh, sh->heap[i]->heap_index);
+	}
+	list_remove(sh, e);
+}
+
+static const struct cache_policy cache_policies[] = {
+	{ "lru", 0, NULL, NULL, lru_insert, lru_hit, lru_victim, lru_victim,
+	  list_remove },
+	{ "clock", 1, NULL, NULL, clock_insert, clock_hit, clock_victim,
+	  clock_peek, list_remove },
+	{ "2q", 0, twoq_init, twoq_miss, twoq_insert, twoq_hit, twoq_victim,
+	  twoq_victim, twoq_remove },
+	{ "arc", 0, arc_init, arc_miss, arc_insert, arc_hit, arc_victim,
+	  arc_victim, arc_remove },
+	{ "gdsf", 0, gdsf_init, NULL, gdsf_insert, gdsf_hit, gdsf_victim,
+	  gdsf_victim, gdsf_remove },
+	{ "gdsf-bytes", 0, gdsf_bytes_init, NULL, gdsf_insert, gdsf_hit,
+	  gdsf_victim, gdsf_victim, gdsf_remove },
+};
+
+#define NR_CACHE_POLICIES \
+	(sizeof(cache_policies) / sizeof(cache_policies[0]))
+
+/* returns the policy called name, or NULL */
+static const struct cache_policy *
+cache_policy_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NR_CACHE_POLICIES; i++) {
+		if (strcmp(cache_policies[i].name, name) == 0)
+			return &cache_policies[i];
+	}
+	return NULL;
+}
+
+/* returns an index table with nr_groups groups, a power of 2, all empty */
+static struct cache_index *
+index_init(unsigned long nr_groups)
+{
+	struct cache_index *idx = Malloc(sizeof(struct cache_index));
+	size_t nr_slots = nr_groups * INDEX_GROUP;
+
+	idx->mask = nr_groups - 1;
+	idx->nr_items = 0;
+	/* keep at least 1/8 of the slots empty, so probes end early */
+	idx->nr_free = nr_slots - nr_slots / 8;
+	idx->ctrl = Malloc_aligned(INDEX_GROUP, nr_slots);
+	memset(idx->ctrl, CTRL_EMPTY, nr_slots);
+	idx->slots = Malloc(sizeof(struct cache_entry *) * nr_slots);
+	memset(idx->slots, 0, sizeof(struct cache_entry *) * nr_slots);
+	idx->retired = 0;
+	idx->next = NULL;
+	return idx;
+}
+
+static void
+index_destroy(struct cache_index *idx)
+{
+	free(idx->ctrl);
+	free(idx->slots);
+	free(idx);
+}
+
+/* spread the bits of the file name hash. the low 7 bits become the tag, the
+ * rest selects the first group to probe. */
+static uint64_t
+index_hash(unsigned long hash)
+{
+	uint64_t h = hash * 0x9e3779b97f4a7c15ULL;
+
+	return h ^ (h >> 32);
+}
+
+/* the control bytes of a group, and bitmasks of its slots that match */
+#ifdef __SSE2__
+typedef __m128i index_group_t;
+
+static inline index_group_t
+index_group(const uint8_t *ctrl)
+{
+	return _mm_load_si128((const __m128i *)ctrl);
+}
+
+/* slots whose control byte is c */
+static inline unsigned
+index_group_match(index_group_t g, uint8_t c)
+{
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(c)));
+}
+
+/* slots without an entry, empty or deleted */
+static inline unsigned
+index_group_unused(index_group_t g)
+{
+	return _mm_movemask_epi8(g);
+}
+#else
+typedef struct {
+	uint8_t c[INDEX_GROUP];
+} index_group_t;
+
+static inline index_group_t
+index_group(const uint8_t *ctrl)
+{
+	index_group_t g;
+	int i;
+
+	for (i = 0; i < INDEX_GROUP; i++) {
+		g.c[i] = __atomic_load_n(&ctrl[i], __ATOMIC_RELAXED);
+	}
+	return g;
+}
+
+static inline unsigned
+index_group_match(index_group_t g, uint8_t c)
+{
+	unsigned bits = 0;
+	int i;
+
+	for (i = 0; i < INDEX_GROUP; i++) {
+		if (g.c[i] == c)
+			bits |= 1U << i;
+	}
+	return bits;
+}
+
+static inline unsigned
+index_group_unused(index_group_t g)
+{
+	unsigned bits = 0;
+	int i;
+
+	for (i = 0; i < INDEX_GROUP; i++) {
+		if (g.c[i] & 0x80)
+			bits |= 1U << i;
+	}
+	return bits;
+}
+#endif
+
+/* groups are probed quadratically, which visits each of them once when their
+ * number is a power of 2. the probe ends at the first group with an empty
+ * slot, since an insert would have used that slot. */
+#define index_for_each_group(idx, h, g, step)				\
+	for ((g) = ((h) >> 7) & (idx)->mask, (step) = 0;		\
+	     (step) <= (idx)->mask;					\
+	     (step)++, (g) = ((g) + (step)) & (idx)->mask)
+
+/* returns the entry for file_name in idx, or NULL */
+static struct cache_entry *
+index_find(struct cache_index *idx, unsigned long hash, const char *file_name)
+{
+	uint64_t h = index_hash(hash);
+	unsigned long g, step;
+
+	index_for_each_group(idx, h, g, step) {
+		index_group_t ctrl = index_group(&idx->ctrl[g * INDEX_GROUP]);
+		unsigned bits = index_group_match(ctrl, h & 0x7f);
+
+		for (; bits; bits &= bits - 1) {
+			struct cache_entry *e = __atomic_load_n(
+				&idx->slots[g * INDEX_GROUP + __builtin_ctz(bits)],
+				__ATOMIC_ACQUIRE);
+
+			if (e && e->hash == hash &&
+			    strcmp(e->data.file_name, file_name) == 0)
+				return e;
+		}
+		if (index_group_match(ctrl, CTRL_EMPTY))
+			break;
+	}
+	return NULL;
+}
+
+/* add e, which is not in idx, to idx, which has a free slot */
+static void
+index_insert(struct cache_index *idx, struct cache_entry *e)
+{
+	uint64_t h = index_hash(e->hash);
+	unsigned long g, step, i;
+	unsigned bits = 0;
+
+	index_for_each_group(idx, h, g, step) {
+		bits = index_group_unused(index_group(&idx->ctrl[g * INDEX_GROUP]));
+		if (bits)
+			break;
+	}
+	assert(bits);
+	i = g * INDEX_GROUP + __builtin_ctz(bits);
+	if (idx->ctrl[i] == CTRL_EMPTY) {
+		idx->nr_free--;
+	}
+	__atomic_store_n(&idx->slots[i], e, __ATOMIC_RELEASE);
+	__atomic_store_n(&idx->ctrl[i], h & 0x7f, __ATOMIC_RELEASE);
+	idx->nr_items++;
+}
+
+/* remove the entry in slot i of idx. the slot can be reused as empty if its
+ * group has another empty slot, since then no probe continues past the group.
+ * otherwise, it is marked deleted, and only reused by inserts, which also
+ * happens while entries are moved out of an old table, whose probes must
+ * still find the entries that remain. */
+static void
+index_clear(struct cache_index *idx, unsigned long i, int draining)
+{
+	uint8_t *group = &idx->ctrl[i / INDEX_GROUP * INDEX_GROUP];
+
+	if (!draining && index_group_match(index_group(group), CTRL_EMPTY)) {
+		__atomic_store_n(&idx->ctrl[i], CTRL_EMPTY, __ATOMIC_RELEASE);
+		idx->nr_free++;
+	} else {
+		__atomic_store_n(&idx->ctrl[i], CTRL_DELETED, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&idx->slots[i], NULL, __ATOMIC_RELEASE);
+	idx->nr_items--;
+}
+
+/* remove e from idx. returns 0 if it isn't there. */
+static int
+index_remove(struct cache_index *idx, struct cache_entry *e, int draining)
+{
+	uint64_t h = index_hash(e->hash);
+	unsigned long g, step;
+
+	index_for_each_group(idx, h, g, step) {
+		index_group_t ctrl = index_group(&idx->ctrl[g * INDEX_GROUP]);
+		unsigned bits = index_group_match(ctrl, h & 0x7f);
+
+		for (; bits; bits &= bits - 1) {
+			unsigned long i = g * INDEX_GROUP + __builtin_ctz(bits);
+
+			if (idx->slots[i] == e) {
+				index_clear(idx, i, draining);
+				return 1;
+			}
+		}
+		if (index_group_match(ctrl, CTRL_EMPTY))
+			break;
+	}
+	return 0;
+}
+
+/* the old table of a shard is no longer used. readers may still be searching
+ * it in lock-free mode, so it is freed once they can't. */
+static void
+index_retire(struct cache *cache, struct cache_shard *sh,
+	     struct cache_index *idx)
+{
+	if (!cache->lockfree) {
+		index_destroy(idx);
+		return;
+	}
+	idx->retired = epoch_retire();
+	if (sh->retired_tail) {
+		sh->retired_tail->next = idx;
+	} else {
+		sh->retired_head = idx;
+	}
+	sh->retired_tail = idx;
+}
+
+/* move up to nr_groups groups of entries from the old table of the shard to
+ * its new one. each entry is in the new table before it is removed from the
+ * old one, which lookups search first. */
+static void
+index_migrate(struct cache *cache, struct cache_shard *sh,
+	      unsigned long nr_groups)
+{
+	struct cache_index *old = sh->old_index;
+	unsigned long i, end;
+
+	end = (sh->migrated + nr_groups) * INDEX_GROUP;
+	if (end > (old->mask + 1) * INDEX_GROUP) {
+		end = (old->mask + 1) * INDEX_GROUP;
+	}
+	for (i = sh->migrated * INDEX_GROUP; i < end; i++) {
+		if (old->ctrl[i] & 0x80)
+			continue;
+		index_insert(sh->index, old->slots[i]);
+		index_clear(old, i, 1);
+	}
+	sh->migrated = end / INDEX_GROUP;
+	if (sh->migrated > old->mask) {
+		__atomic_store_n(&sh->old_index, NULL, __ATOMIC_RELEASE);
+		index_retire(cache, sh, old);
+	}
+}
+
+/* make sure the shard's index has a free slot for another entry */
+static void
+index_reserve(struct cache *cache, struct cache_shard *sh)
+{
+	struct cache_index *idx = sh->index;
+	unsigned long nr_groups = idx->mask + 1;
+
+	if (sh->old_index) {
+		index_migrate(cache, sh, INDEX_MIGRATE);
+	}
+	if (idx->nr_free > 0)
+		return;
+	if (sh->old_index) {
+		/* can't have two old tables, finish moving this one */
+		index_migrate(cache, sh, sh->old_index->mask + 1);
+	}
+	/* grow if more than half the usable slots hold entries, otherwise
+	 * there are enough deleted slots to reuse by rehashing */
+	if (idx->nr_items > (nr_groups * INDEX_GROUP - nr_groups * 2) / 2) {
+		nr_groups *= 2;
+	}
+	sh->migrated = 0;
+	/* readers must find the old table once they see the new one */
+	__atomic_store_n(&sh->old_index, idx, __ATOMIC_RELEASE);
+	__atomic_store_n(&sh->index, index_init(nr_groups), __ATOMIC_RELEASE);
+	index_migrate(cache, sh, INDEX_MIGRATE);
+}
+
+static struct cache *
+cache_init(int max_size, int nr_shards, int lockfree,
+	   const struct cache_policy *policy, int admission, int arena)
+{
+	struct cache *cache;
+	int i;
+
+	cache = Malloc(sizeof(struct cache));
+	cache->nr_shards = nr_shards;
+	cache->lockfree = lockfree;
+	cache->policy = policy;
+	cache->shards = Malloc_aligned(64, sizeof(struct cache_shard) *
+				       nr_shards);
+	memset(cache->shards, 0, sizeof(struct cache_shard) * nr_shards);
+	for (i = 0; i < nr_shards; i++) {
+		struct cache_shard *sh = &cache->shards[i];
+
+		pthread_mutex_init(&sh->lock, NULL);
+		pthread_cond_init(&sh->loaded, NULL);
+		sh->max_size = max_size / nr_shards;
+		sh->nr_buckets = CACHE_BUCKETS / nr_shards + 1;
+		sh->index = index_init(1);
+		if (arena) {
+			/* the arena's metadata comes out of the shard's
+			 * share, too */
+			sh->slab = slab_init(sh->max_size);
+			sh->max_size = slab_capacity(sh->slab);
+		}
+		if (policy->init) {
+			policy->init(sh);
+		}
+		if (admission) {
+			sh->sketch = tinylfu_init(sh->max_size /
+						  SKETCH_FILE_SIZE + 1);
+		}
+	}
+	return cache;
+}
+
+static void
+cache_destroy(struct cache *cache)
+{
+	struct cache_entry *e, *next;
+	struct cache_index *idx;
+	int i, j;
+
+	for (i = 0; i < cache->nr_shards; i++) {
+		struct cache_shard *sh = &cache->shards[i];
+
+		for (j = 0; j < 2; j++) {
+			for (e = sh->list[j].head; e; e = next) {
+				next = e->next;
+				cache_put(e);
+			}
+			ghost_destroy(&sh->ghost[j]);
+		}
+		for (e = sh->limbo_head; e; e = next) {
+			next = e->next;
+			cache_put(e);
+		}
+		pthread_mutex_destroy(&sh->lock);
+		pthread_cond_destroy(&sh->loaded);
+		index_destroy(sh->index);
+		if (sh->old_index) {
+			index_destroy(sh->old_index);
+		}
+		while ((idx = sh->retired_head)) {
+			sh->retired_head = idx->next;
+			index_destroy(idx);
+		}
+		free(sh->heap);
+		if (sh->sketch) {
+			tinylfu_destroy(sh->sketch);
+		}
+		if (sh->slab) {
+			slab_destroy(sh->slab);
+		}
+	}
+	free(cache->shards);
+	free(cache);
+}
+
+/* returns the shard that caches the file with this hash */
+static struct cache_shard *
+cache_shard(struct cache *cache, unsigned long hash)
+{
+	return &cache->shards[hash % cache->nr_shards];
+}
+
+/* bytes needed for the entry of a file */
+static size_t
+cache_entry_alloc_size(struct file_data *data)
+{
+	return sizeof(struct cache_entry) + strlen(data->file_name) + 1 +
+		REQUEST_HEADER_MAX + data->file_size;
+}
+
+/* bytes charged against the cache for holding a file, which includes the
+ * rounding up to a size class of the arena */
+static int
+cache_entry_size(struct cache_shard *sh, struct file_data *data)
+{
+	size_t size = cache_entry_alloc_size(data);
+
+	if (sh->slab)
+		return slab_size(sh->slab, size);
+	return size;
+}
+
+/* returns the cache entry for file_name, or NULL. the entry is not pinned.
+ * sh->lock must be held, or in lock-free mode, the caller must be in an epoch
+ * critical section. a lock-free lookup that races with the index being
+ * replaced may miss an entry, which is found again under the lock. */
+static struct cache_entry *
+cache_lookup(struct cache *cache, struct cache_shard *sh, unsigned long hash,
+	     const char *file_name)
+{
+	struct cache_index *idx, *old;
+	struct cache_entry *e;
+
+	idx = __atomic_load_n(&sh->index, __ATOMIC_ACQUIRE);
+	old = __atomic_load_n(&sh->old_index, __ATOMIC_ACQUIRE);
+	if (old && old != idx && (e = index_find(old, hash, file_name)))
+		return e;
+	return index_find(idx, hash, file_name);
+}
+
+/* drop the cache's reference to evicted entries, and free replaced index
+ * tables, that no reader can find */
+static void
+cache_reclaim(struct cache_shard *sh)
+{
+	struct cache_entry *e;
+	struct cache_index *idx;
+
+	while ((idx = sh->retired_head) && epoch_safe(idx->retired)) {
+		sh->retired_head = idx->next;
+		if (!sh->retired_head) {
+			sh->retired_tail = NULL;
+		}
+		index_destroy(idx);
+	}
+
+	while ((e = sh->limbo_head) && epoch_safe(e->retired)) {
+		sh->limbo_head = e->next;
+		if (!sh->limbo_head) {
+			sh->limbo_tail = NULL;
+		}
+		cache_put(e);
+	}
+}
+
+/* evict the entry chosen by the policy. returns 0 if there is none. */
+static int
+cache_evict_one(struct cache *cache, struct cache_shard *sh)
+{
+	struct cache_entry *e = cache->policy->victim(sh);
+
+	if (!e)
+		return 0;
+	cache->policy->remove(sh, e);
+	if (!sh->old_index || !index_remove(sh->old_index, e, 1)) {
+		index_remove(sh->index, e, 0);
+	}
+	sh->size -= e->size;
+	if (!cache->lockfree) {
+		/* drop the cache's reference, senders may still hold theirs */
+		cache_put(e);
+		return 1;
+	}
+	e->retired = epoch_retire();
+	if (sh->limbo_tail) {
+		sh->limbo_tail->next = e;
+	} else {
+		sh->limbo_head = e;
+	}
+	sh->limbo_tail = e;
+	return 1;
+}
+
+/* evict entries chosen by the policy until at least space_required bytes are
+ * available in the shard. returns 0 if that many bytes can't be freed, because
+ * they are reserved by files being read. */
+static int
+cache_evict(struct cache *cache, struct cache_shard *sh, int space_required)
+{
+	int ret = 1;
+
+	while (sh->max_size - sh->size < space_required) {
+		if (!cache_evict_one(cache, sh)) {
+			ret = 0;
+			break;
+		}
+	}
+	if (cache->lockfree) {
+		cache_reclaim(sh);
+	}
+	return ret;
+}
+
+/* returns 1 if a file should be cached, according to the admission filter */
+static int
+cache_admit(struct cache *cache, struct cache_shard *sh, unsigned long hash,
+	    int size)
+{
+	struct cache_entry *victim;
+
+	if (!sh->sketch)
+		return 1;
+	if (sh->max_size - sh->size >= size) {
+		/* there is room, no other file has to be evicted */
+		sh->admitted++;
+		return 1;
+	}
+	victim = cache->policy->peek(sh);
+	if (!victim || tinylfu_estimate(sh->sketch, hash) >
+	    tinylfu_estimate(sh->sketch, victim->hash)) {
+		sh->admitted++;
+		return 1;
+	}
+	sh->rejected++;
+	return 0;
+}
+
+/* fill in a new entry for the file in data, charged size bytes */
+static void
+cache_entry_init(struct cache_entry *e, unsigned long hash,
+		 struct file_data *data, int size, struct slab *slab)
+{
+	int len = strlen(data->file_name);
+
+	memcpy(e->name, data->file_name, len + 1);
+	e->data.file_name = e->name;
+	e->data.file_buf = e->name + len + 1 + REQUEST_HEADER_MAX;
+	e->data.file_size = data->file_size;
+	e->data.header = NULL;
+	e->data.header_size = 0;
+	e->hash = hash;
+	e->size = size;
+	e->loading = 0;
+	e->error = 0;
+	/* the caller's reference, the cache gets its own when it is linked */
+	e->refcnt = 1;
+	e->referenced = 0;
+	e->retired = 0;
+	e->slab = slab;
+}
+
+/* allocate an entry for the file in data, whose size is known, and make room
+ * for it in the shard. the entry is charged to the shard but not linked, so
+ * that the file can be read into it without holding the lock. returns NULL if
+ * the file is too large to be cached or is not admitted. sh->lock must be
+ * held. */
+static struct cache_entry *
+cache_reserve(struct cache *cache, struct cache_shard *sh, unsigned long hash,
+	      struct file_data *data)
+{
+	struct cache_entry *e;
+	size_t alloc_size = cache_entry_alloc_size(data);
+	int size = cache_entry_size(sh, data);
+
+	if (size > sh->max_size)
+		return NULL;
+	/* the policy learns of the miss before it picks the victims */
+	if (cache->policy->miss) {
+		cache->policy->miss(sh, hash);
+	}
+	if (!cache_admit(cache, sh, hash, size))
+		return NULL;
+	if (!cache_evict(cache, sh, size))
+		return NULL;
+	if (sh->slab) {
+		/* the arena may be too fragmented for the entry even though
+		 * the shard has room for it */
+		while (!(e = slab_alloc(sh->slab, alloc_size))) {
+			if (!cache_evict_one(cache, sh))
+				return NULL;
+			if (cache->lockfree) {
+				cache_reclaim(sh);
+			}
+		}
+	} else {
+		e = Malloc(alloc_size);
+	}
+	cache_entry_init(e, hash, data, size, sh->slab);
+	/* other misses may come before the entry is inserted */
+	e->ghost_hit = sh->ghost_hit;
+	sh->size += size;
+	return e;
+}
+
+/* returns an entry for a file that won't be cached, so that concurrent
+ * requests for the file can still share one read of it. it can't come from
+ * the worker's arena, since the requests on other threads that wait for the
+ * read may put it after the arena has been reset for the next request. */
+static struct cache_entry *
+cache_reserve_uncached(unsigned long hash, struct file_data *data)
+{
+	struct cache_entry *e = Malloc(cache_entry_alloc_size(data));
+
+	cache_entry_init(e, hash, data, 0, NULL);
+	return e;
+}
+
+/* give up a reserved entry */
+static void
+cache_unreserve(struct cache_shard *sh, struct cache_entry *e)
+{
+	sh->size -= e->size;
+	cache_put(e);
+}
+
+/* insert a reserved entry, once the file has been read into it, and return it
+ * pinned. if another thread has cached the file in the meantime, the
+ * reservation is given up and the other entry is returned instead. sh->lock
+ * must be held. */
+static struct cache_entry *
+cache_link(struct cache *cache, struct cache_shard *sh, struct cache_entry *e)
+{
+	struct cache_entry *old;
+
+	old = cache_lookup(cache, sh, e->hash, e->data.file_name);
+	if (old) {
+		cache_unreserve(sh, e);
+		cache_get(old);
+		return old;
+	}
+	cache_get(e);
+	index_reserve(cache, sh);
+	sh->ghost_hit = e->ghost_hit;
+	index_insert(sh->index, e);
+	cache->policy->insert(sh, e);
+	sh->ghost_hit = 0;
+	return e;
+}
+
+/* e is about to be read, see cache_wait. sh->lock must be held. */
+static void
+cache_load_start(struct cache_shard *sh, struct cache_entry *e)
+{
+	e->loading = 1;
+	e->prev = NULL;
+	e->next = sh->loading;
+	if (sh->loading) {
+		sh->loading->prev = e;
+	}
+	sh->loading = e;
+}
+
+/* e has been read, wake up the requests waiting for it. sh->lock must be
+ * held. */
+static void
+cache_load_done(struct cache_shard *sh, struct cache_entry *e)
+{
+	if (e->prev) {
+		e->prev->next = e->next;
+	} else {
+		sh->loading = e->next;
+	}
+	if (e->next) {
+		e->next->prev = e->prev;
+	}
+	e->loading = 0;
+	pthread_cond_broadcast(&sh->loaded);
+}
+
+/* if file_name is being read, wait for it and return its entry pinned, or
+ * return NULL. sh->lock must be held. */
+static struct cache_entry *
+cache_wait(struct cache_shard *sh, unsigned long hash, const char *file_name)
+{
+	struct cache_entry *e;
+
+	for (e = sh->loading; e; e = e->next) {
+		if (e->hash == hash && strcmp(e->data.file_name, file_name) == 0)
+			break;
+	}
+	if (!e)
+		return NULL;
+	cache_get(e);
+	while (e->loading) {
+		pthread_cond_wait(&sh->loaded, &sh->lock);
+	}
+	return e;
+}
+
+/* read the next request on conn, and put together its response in rp. returns
+ * 0 if there is none, because the client closed the connection or sent a bad
+ * request. with hold, a lock-free hit leaves the epoch held instead of
+ * pinning its entry, for the caller to send it right away. */
+static int
+server_handle(struct server *sv, struct conn *conn, struct reply *rp,
+	      int hold)
+{
+	int ret;
+	struct request *rq;
+	struct file_data *data;
+	struct cache_entry *e = NULL;
+	struct cache_entry *reserved = NULL;
+	struct cache_shard *sh = NULL;
+	unsigned long hash = 0;
+	struct stats *stats = stats_get(sv);
+	struct cache *cache = thread_cache ? thread_cache : sv->cache;
+
+	data = &rp->data;
+	file_data_init(data);
+	rp->held = 0;
+
+	/* fill data->file_name with name of the file being requested */
+	rq = request_init(conn, data);
+	if (!rq) {
+		file_data_free(data);
+		rp->rq = NULL;
+		return 0;
+	}
+	stats->requests++;
+
+	if (cache) {
+		hash = cache_hash(data->file_name);
+		sh = cache_shard(cache, hash);
+		if (sh->sketch) {
+			tinylfu_record(sh->sketch, hash);
+		}
+		if (cache->lockfree) {
+			epoch_enter();
+		} else {
+			pthread_mutex_lock(&sh->lock);
+		}
+		e = cache_lookup(cache, sh, hash, data->file_name);
+		if (e) {
+			cache->policy->hit(sh, e);
+			rp->held = cache->lockfree && hold;
+			if (!rp->held) {
+				cache_get(e);
+			}
+		}
+		if (cache->lockfree) {
+			/* do_server_request leaves it after a held hit */
+			if (!rp->held)
+				epoch_exit();
+		} else {
+			pthread_mutex_unlock(&sh->lock);
+		}
+		if (e) {
+			stats->hits++;
+			stats->hit_bytes += e->data.file_size;
+		} else {
+			stats->misses++;
+		}
+	}
+
+	if (!e && !sh && sv->zerocopy) {
+		/* the file is sent straight from the file system */
+		ret = request_stat(rq);
+		if (ret == 0) { /* couldn't read file */
+			goto out;
+		}
+	} else if (!e && !sh) {
+		/* read file, 
+		 * fills data->file_buf with the file contents,
+		 * data->file_size with file size. */
+		ret = request_readfile(rq, thread_arena);
+		if (ret == 0) { /* couldn't read file */
+			goto out;
+		}
+	} else if (!e) {
+		/* find the file size first, so that a file that will be cached
+		 * can be read straight into its cache entry */
+		ret = request_stat(rq);
+		if (ret == 0) { /* couldn't read file */
+			goto out;
+		}
+		stats->miss_bytes += data->file_size;
+		pthread_mutex_lock(&sh->lock);
+		/* another thread may have cached the file meanwhile, or may be
+		 * reading it */
+		e = cache_lookup(cache, sh, hash, data->file_name);
+		if (e) {
+			cache_get(e);
+		} else if ((e = cache_wait(sh, hash, data->file_name))) {
+			stats->coalesced++;
+		} else {
+			reserved = cache_reserve(cache, sh, hash, data);
+			if (!reserved && !sv->zerocopy) {
+				reserved = cache_reserve_uncached(hash, data);
+			}
+			if (reserved) {
+				cache_load_start(sh, reserved);
+			}
+		}
+		pthread_mutex_unlock(&sh->lock);
+		if (e && e->error) {
+			/* the read we waited for failed */
+			request_fail(rq, e->error);
+			cache_put(e);
+			e = NULL;
+			goto out;
+		}
+		if (reserved) {
+			stats->reads++;
+			if (thread_files) {
+				ret = request_read_uring(rq,
+							 reserved->data.file_buf,
+							 thread_files);
+			} else {
+				ret = request_read(rq, reserved->data.file_buf);
+			}
+			if (ret) {
+				request_set_data(rq, &reserved->data);
+				request_prepare(rq);
+			} else {
+				reserved->error = errno;
+			}
+			pthread_mutex_lock(&sh->lock);
+			/* waiters see the error, and send their own response */
+			cache_load_done(sh, reserved);
+			if (!ret) {
+				if (reserved->size) {
+					cache_unreserve(sh, reserved);
+				} else {
+					cache_put(reserved);
+				}
+			} else if (reserved->size) {
+				e = cache_link(cache, sh, reserved);
+			} else {
+				e = reserved;
+			}
+			pthread_mutex_unlock(&sh->lock);
+			if (!ret) { /* couldn't read file */
+				goto out;
+			}
+		}
+	}
+	/* send file to client, straight from its entry when it has one. the
+	 * entry is pinned or the epoch held, so it can't be freed under us,
+	 * even if it is evicted. */
+	if (e) {
+		request_set_data(rq, &e->data);
+		request_sendfile(rq);
+	} else if (sv->zerocopy) {
+		unsigned int csum;
+		int found = sv->csums && csums_find(sv->csums, data->file_name,
+						    data->file_size, &csum);
+
+		if (!request_sendfile_direct(rq, found ? &csum : NULL))
+			goto out;
+		stats->direct++;
+		stats->direct_csums += found;
+	} else {
+		request_sendfile(rq);
+	}
+out:
+	rp->rq = rq;
+	rp->e = e;
+	return 1;
+}
+
+/* the response to rp has been sent, or given up on */
+static void
+reply_done(struct reply *rp)
+{
+	if (rp->e) {
+		cache_put(rp->e);
+	}
+	request_destroy(rp->rq);
+	file_data_free(&rp->data);
+	rp->rq = NULL;
+}
+
+/* serve the next request on conn. returns 1 if the connection stays open for
+ * another request. */
+static int
+do_server_request(struct server *sv, struct conn *conn)
+{
+	struct reply reply;
+	int keep_alive, ret = 0;
+
+	if (!server_handle(sv, conn, &reply, 1))
+		return 0;
+	/* a lock-free hit goes out while the epoch is still held, as far as
+	 * the socket takes it without waiting, which saves two atomic updates
+	 * of the entry's refcnt. the entry is only pinned for what is left,
+	 * since a slow client must not hold up reclaiming evicted entries. */
+	if (reply.held) {
+		ret = request_flush_nowait(reply.rq);
+		if (ret == 0) {
+			cache_get(reply.e);
+		} else {
+			reply.e = NULL;
+		}
+		epoch_exit();
+	}
+	/* the socket is blocking, so the response is sent unless the
+	 * connection fails */
+	if (ret == 0) {
+		ret = request_flush(reply.rq);
+	}
+	keep_alive = ret > 0 && request_keep_alive(reply.rq);
+	reply_done(&reply);
+	/* nothing from the arena outlives the request */
+	if (thread_arena) {
+		arena_reset(thread_arena);
+	}
+	return keep_alive;
+}
+
+/* returns the monotonic time in ms */
+static long
+idle_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* conn waits for its next request. the idle thread is woken up when there was
+ * no connection waiting, since it may be sleeping without a timeout. */
+static void
+idle_park(struct idle *idle, struct conn *conn)
+{
+	int fd = conn_fd(conn);
+	struct idle_conn *ic = &idle->conns[fd];
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP };
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&idle->lock);
+	if (idle->exiting || fd >= idle->nr_fds) {
+		pthread_mutex_unlock(&idle->lock);
+		conn_destroy(conn);
+		return;
+	}
+	ic->conn = conn;
+	ic->since = idle_now();
+	ic->prev = idle->tail;
+	ic->next = -1;
+	if (idle->tail >= 0) {
+		idle->conns[idle->tail].next = fd;
+	} else {
+		idle->head = fd;
+		SYS(write(idle->wakefd, &one, sizeof(one)));
+	}
+	idle->tail = fd;
+	ev.data.fd = fd;
+	SYS(epoll_ctl(idle->epfd, EPOLL_CTL_ADD, fd, &ev));
+	pthread_mutex_unlock(&idle->lock);
+}
+
+/* stop watching the connection with this fd, and return it. idle->lock must
+ * be held. */
+static struct conn *
+idle_unpark(struct idle *idle, int fd)
+{
+	struct idle_conn *ic = &idle->conns[fd];
+	struct conn *conn = ic->conn;
+
+	if (!conn)
+		return NULL;
+	if (ic->prev >= 0) {
+		idle->conns[ic->prev].next = ic->next;
+	} else {
+		idle->head = ic->next;
+	}
+	if (ic->next >= 0) {
+		idle->conns[ic->next].prev = ic->prev;
+	} else {
+		idle->tail = ic->prev;
+	}
+	ic->conn = NULL;
+	SYS(epoll_ctl(idle->epfd, EPOLL_CTL_DEL, fd, NULL));
+	return conn;
+}
+
+/* serve requests on conn, including any pipelined behind each other, until it
+ * has to wait for the client */
+static void
+do_server_conn(struct server *sv, struct conn *conn)
+{
+	do {
+		if (!do_server_request(sv, conn)) {
+			conn_destroy(conn);
+			return;
+		}
+	} while (conn_pending(conn));
+	idle_park(sv->idle, conn);
+}
+
+static void *do_server_thread(void *arg);
+
+/* run a thread for w */
+static void
+worker_start(struct worker *w)
+{
+	pthread_attr_t attr;
+
+	server_attr(w->sv, &attr, w->id);
+	SYS(pthread_attr_setstacksize(&attr, WORKER_STACK));
+	__atomic_store_n(&w->active, 1, __ATOMIC_RELEASE);
+	SYS(pthread_create(&w->thread, &attr, do_server_thread, w));
+	w->started = 1;
+	SYS(pthread_attr_destroy(&attr));
+}
+
+/* start another worker, unless the pool is at its largest */
+static void
+pool_grow(struct server *sv)
+{
+	struct worker *w;
+	int i;
+
+	if (__atomic_load_n(&sv->nr_active, __ATOMIC_RELAXED) >= sv->nr_threads)
+		return;
+	pthread_mutex_lock(&sv->pool_lock);
+	if (sv->nr_active < sv->nr_threads && !sv->exiting) {
+		for (i = 0; sv->workers[i].active; i++)
+			;
+		w = &sv->workers[i];
+		/* the thread of a retired worker exits right away */
+		if (w->started) {
+			pthread_join(w->thread, NULL);
+		}
+		worker_start(w);
+		__atomic_store_n(&sv->nr_active, sv->nr_active + 1,
+				 __ATOMIC_RELAXED);
+		sv->started++;
+		if (sv->nr_active > sv->peak_threads) {
+			sv->peak_threads = sv->nr_active;
+		}
+	}
+	pthread_mutex_unlock(&sv->pool_lock);
+}
+
+/* w has been idle for a while. returns 1 if it should exit, leaving any
+ * connections queued for it to be stolen by the others. */
+static int
+pool_retire(struct worker *w)
+{
+	struct server *sv = w->sv;
+	int retire = 0;
+
+	pthread_mutex_lock(&sv->pool_lock);
+	if (sv->nr_active > sv->min_threads && !sv->exiting) {
+		__atomic_store_n(&w->active, 0, __ATOMIC_RELEASE);
+		__atomic_store_n(&sv->nr_active, sv->nr_active - 1,
+				 __ATOMIC_RELAXED);
+		sv->retired++;
+		retire = 1;
+	}
+	pthread_mutex_unlock(&sv->pool_lock);
+	return retire;
+}
+
+/* returns the scheduler for the policy called name, or NULL for fifo. exits
+ * if there is no such policy. */
+static struct sched *
+sched_init(const char *name, int nr_threads, int max_requests)
+{
+	struct sched *sched;
+	int i, policy;
+
+	for (policy = 0; policy < NR_SCHED_POLICIES; policy++) {
+		if (strcmp(sched_policies[policy], name) == 0)
+			break;
+	}
+	if (policy == NR_SCHED_POLICIES) {
+		fprintf(stderr, "unknown scheduling policy: %s\n", name);
+		exit(1);
+	}
+	if (policy == ORDER_FIFO)
+		return NULL;
+	sched = Malloc(sizeof(struct sched));
+	sched->policy = policy;
+	pthread_mutex_init(&sched->lock, NULL);
+	sched->max_conns = max_requests > 0 ? max_requests : 1;
+	sched->nr_conns = 0;
+	for (i = 0; i < 2; i++) {
+		sched->lanes[i].conns = Malloc(sizeof(struct sched_conn) *
+					       sched->max_conns);
+		sched->lanes[i].nr_conns = 0;
+	}
+	sched->nr_large = nr_threads / 4 > 0 ? nr_threads / 4 : 1;
+	return sched;
+}
+
+/* the workers have exited, so any connection left is closed */
+static void
+sched_destroy(struct sched *sched)
+{
+	int i, j;
+
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < sched->lanes[i].nr_conns; j++) {
+			conn_destroy(sched->lanes[i].conns[j].conn);
+		}
+		free(sched->lanes[i].conns);
+	}
+	pthread_mutex_destroy(&sched->lock);
+	free(sched);
+}
+
+static void
+sched_heap_push(struct sched_heap *h, long key, struct conn *conn)
+{
+	int i = h->nr_conns++;
+
+	while (i > 0 && h->conns[(i - 1) / 2].key > key) {
+		h->conns[i] = h->conns[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	h->conns[i].key = key;
+	h->conns[i].conn = conn;
+}
+
+static struct conn *
+sched_heap_pop(struct sched_heap *h)
+{
+	struct conn *conn = h->conns[0].conn;
+	struct sched_conn last = h->conns[--h->nr_conns];
+	int i = 0, child;
+
+	while ((child = 2 * i + 1) < h->nr_conns) {
+		if (child + 1 < h->nr_conns &&
+		    h->conns[child + 1].key < h->conns[child].key)
+			child++;
+		if (h->conns[child].key >= last.key)
+			break;
+		h->conns[i] = h->conns[child];
+		i = child;
+	}
+	h->conns[i] = last;
+	return conn;
+}
+
+/* returns 1 if there may be room for another connection */
+static int
+sched_room(struct sched *sched)
+{
+	return __atomic_load_n(&sched->nr_conns, __ATOMIC_RELAXED) <
+		sched->max_conns;
+}
+
+/* returns the size of the file called name, from its cache entry if it has
+ * one, or else from the file system, or 0 if there is no such file */
+static long
+server_file_size(struct server *sv, const char *name)
+{
+	struct cache *cache = sv->cache;
+	struct cache_shard *sh;
+	struct cache_entry *e;
+	unsigned long hash;
+	struct stat st;
+	long size = -1;
+
+	if (cache) {
+		hash = cache_hash(name);
+		sh = cache_shard(cache, hash);
+		/* only a peek, which the policy and the sketch don't see */
+		if (cache->lockfree) {
+			epoch_enter();
+		} else {
+			pthread_mutex_lock(&sh->lock);
+		}
+		e = cache_lookup(cache, sh, hash, name);
+		if (e) {
+			size = e->data.file_size;
+		}
+		if (cache->lockfree) {
+			epoch_exit();
+		} else {
+			pthread_mutex_unlock(&sh->lock);
+		}
+		if (size >= 0) {
+			stats_get(sv)->sized_cached++;
+			return size;
+		}
+	}
+	stats_get(sv)->sized++;
+	if (stat(name, &st) < 0)
+		return 0;
+	return st.st_size;
+}
+
+/* hand conn, which has a request buffered, to the scheduler by the size of the
+ * file it asks for. returns conn if it should be served right away, because
+ * the scheduler has no room for it, or else NULL. */
+static struct conn *
+server_classify(struct server *sv, struct conn *conn)
+{
+	struct sched *sched = sv->sched;
+	char name[MAXLINE];
+	long size = 0;
+	int ret, large;
+
+	ret = conn_parse(conn);
+	/* a malformed request gets a short error response */
+	if (ret > 0 && conn_file_name(conn, name, sizeof(name))) {
+		size = server_file_size(sv, name);
+	}
+	large = sched->policy == ORDER_LANES && size > LANE_LARGE;
+	pthread_mutex_lock(&sched->lock);
+	if (sched->nr_conns == sched->max_conns) {
+		pthread_mutex_unlock(&sched->lock);
+		return conn;
+	}
+	if (sched->policy == ORDER_SRPT) {
+		sched_heap_push(&sched->lanes[0],
+				conn_stamp(conn) + size / SRPT_AGING, conn);
+	} else {
+		sched_heap_push(&sched->lanes[large], conn_stamp(conn), conn);
+	}
+	__atomic_store_n(&sched->nr_conns, sched->nr_conns + 1,
+			 __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&sched->lock);
+	stats_get(sv)->large += large;
+	eventcount_notify(&sv->not_empty, 1);
+	return NULL;
+}
+
+/* returns the next connection w should serve from the scheduler, or NULL */
+static struct conn *
+sched_pop(struct worker *w)
+{
+	struct sched *sched = w->sv->sched;
+	struct sched_heap *small = &sched->lanes[0];
+	struct sched_heap *large = &sched->lanes[1];
+	struct sched_heap *h = small;
+	struct conn *conn = NULL;
+
+	pthread_mutex_lock(&sched->lock);
+	if (large->nr_conns > 0) {
+		if (w->id < sched->nr_large) {
+			h = large;
+		} else if (large->conns[0].key + LANE_STARVE <= idle_now()) {
+			/* the large lane is falling behind */
+			h = large;
+			stats_get(w->sv)->starved++;
+		}
+	}
+	/* large-lane workers serve small files when there are no large ones */
+	if (h->nr_conns == 0 && h == large) {
+		h = small;
+	}
+	if (h->nr_conns > 0) {
+		conn = sched_heap_pop(h);
+		__atomic_store_n(&sched->nr_conns, sched->nr_conns - 1,
+				 __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&sched->lock);
+	return conn;
+}
+
+/* take up to WORKER_BATCH connections from q into w's batch, but no more than
+ * half of those waiting, so that idle workers can steal the rest. returns
+ * how many. */
+static int
+worker_grab(struct worker *w, struct queue *q)
+{
+	unsigned long share;
+	int n = 0;
+
+	share = (queue_length(q) + 1) / 2;
+	if (share > WORKER_BATCH) {
+		share = WORKER_BATCH;
+	}
+	do {
+		if (!(w->batch[n] = queue_pop(q)))
+			break;
+		n++;
+	} while (n < share);
+	w->nr_batch = n;
+	w->next_batch = 0;
+	return n;
+}
+
+/* returns the oldest connection taken for w. when there are none, a batch is
+ * taken from its queue, or else stolen from another worker's. returns NULL if
+ * all are empty. */
+static struct conn *
+worker_next(struct worker *w)
+{
+	struct server *sv = w->sv;
+	int i, n;
+
+	if (w->next_batch == w->nr_batch && !worker_grab(w, w->conns)) {
+		for (i = 1; i < sv->nr_threads; i++) {
+			n = worker_grab(w, sv->workers[(w->id + i) %
+						       sv->nr_threads].conns);
+			if (n > 0) {
+				stats_get(sv)->steals += n;
+				break;
+			}
+		}
+	}
+	if (w->next_batch == w->nr_batch)
+		return NULL;
+	return w->batch[w->next_batch++];
+}
+
+/* returns the connection w should serve next, or NULL. with a scheduler,
+ * queued connections whose request has arrived are classified first while
+ * there is room, so that the next one is picked among all of them. the others
+ * are served right away, since waiting for their request would block the
+ * worker behind a slow client. */
+static struct conn *
+worker_pop(struct worker *w)
+{
+	struct server *sv = w->sv;
+	struct conn *conn;
+
+	if (!sv->sched)
+		return worker_next(w);
+	while (sched_room(sv->sched) && (conn = worker_next(w))) {
+		if (!conn_arrived(conn))
+			return conn;
+		/* there is room in the queues */
+		eventcount_notify(&sv->not_full, 1);
+		if ((conn = server_classify(sv, conn)))
+			return conn;
+	}
+	return sched_pop(w);
+}
+
+/* wait for a connection for w. returns NULL once the server is exiting and
+ * there are none left. */
+static struct conn *
+worker_take(struct worker *w)
+{
+	struct server *sv = w->sv;
+	struct conn *conn;
+	unsigned int key;
+	int elastic = sv->min_threads < sv->nr_threads;
+
+	while (!(conn = worker_pop(w))) {
+		key = eventcount_prepare(&sv->not_empty);
+		if ((conn = worker_pop(w)) ||
+		    __atomic_load_n(&sv->exiting, __ATOMIC_ACQUIRE)) {
+			eventcount_cancel(&sv->not_empty);
+			break;
+		}
+		stats_get(sv)->sleeps++;
+		/* the queues were drained, so nothing is standing in them */
+		if (sv->target) {
+			__atomic_store_n(&sv->codel_min, 0, __ATOMIC_RELAXED);
+		}
+		if (!eventcount_wait(&sv->not_empty, key,
+				     elastic ? POOL_RETIRE : -1) &&
+		    pool_retire(w))
+			return NULL;
+	}
+	if (conn) {
+		eventcount_notify(&sv->not_full, 1);
+		/* connections wait for workers, so add one */
+		if (elastic && idle_now() - conn_stamp(conn) > POOL_GROW_DELAY) {
+			pool_grow(sv);
+		}
+	}
+	return conn;
+}
+
+/* returns 1 if conn, which was just taken from the queue, waited so long that
+ * it should be shed, after CoDel. a queue that absorbs a burst drains again,
+ * so that some connection waits less than the target in each interval. when
+ * none does, the queue is standing, and connections that waited longer than
+ * the target are shed until waits drop below it again. */
+static int
+server_late(struct server *sv, struct conn *conn)
+{
+	long now, end, min, wait, limit;
+	int overloaded;
+
+	if (!sv->target)
+		return 0;
+	now = idle_now();
+	wait = now - conn_stamp(conn);
+	end = __atomic_load_n(&sv->codel_end, __ATOMIC_RELAXED);
+	if (now >= end &&
+	    __atomic_compare_exchange_n(&sv->codel_end, &end,
+					now + CODEL_INTERVAL, 0,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		/* this thread starts the next interval */
+		min = __atomic_exchange_n(&sv->codel_min, wait,
+					  __ATOMIC_RELAXED);
+		overloaded = min > sv->target;
+		__atomic_store_n(&sv->overloaded, overloaded,
+				 __ATOMIC_RELAXED);
+		stats_get(sv)->overloaded += overloaded;
+	} else {
+		min = __atomic_load_n(&sv->codel_min, __ATOMIC_RELAXED);
+		while (wait < min &&
+		       !__atomic_compare_exchange_n(&sv->codel_min, &min, wait,
+						    1, __ATOMIC_RELAXED,
+						    __ATOMIC_RELAXED))
+			;
+		overloaded = __atomic_load_n(&sv->overloaded,
+					     __ATOMIC_RELAXED);
+	}
+	/* outside of overload, only connections that waited for a whole
+	 * interval are shed, and never those that waited less than the
+	 * target */
+	limit = sv->target;
+	if (!overloaded && limit < CODEL_INTERVAL)
+		limit = CODEL_INTERVAL;
+	if (wait > limit) {
+		stats_get(sv)->shed_late++;
+		return 1;
+	}
+	return 0;
+}
+
+static void *
+do_server_thread(void *arg)
+{
+	struct worker *w = (struct worker *)arg;
+	struct conn *conn;
+
+	thread_arena = arena_init(WORKER_ARENA);
+	while ((conn = worker_take(w))) {
+		if (server_late(w->sv, conn)) {
+			conn_shed(conn);
+			continue;
+		}
+		/* now serve requests */
+		do_server_conn(w->sv, conn);
+	}
+	arena_destroy(thread_arena);
+	thread_arena = NULL;
+	return NULL;
+}
+
+/* queue conn for the first worker from start on that has room. returns 0 if
+ * none has. */
+static int
+server_push(struct server *sv, unsigned int start, struct conn *conn)
+{
+	struct worker *w;
+	int i;
+
+	for (i = 0; i < sv->nr_threads; i++) {
+		w = &sv->workers[(start + i) % sv->nr_threads];
+		if (__atomic_load_n(&w->active, __ATOMIC_ACQUIRE) &&
+		    queue_push(w->conns, conn))
+			return 1;
+	}
+	return 0;
+}
+
+/* queue conn for the worker threads, which are notified by the caller */
+static void
+server_queue(struct server *sv, struct conn *conn)
+{
+	unsigned int key, start;
+
+	/* hand the connection to the worker threads in turn, waiting for room
+	 * if all of them are busy and their queues are full. a worker that is
+	 * woken up takes it even if it was queued for another. */
+	start = server_steer(sv, conn_fd(conn), &sv->next_worker,
+			     sv->nr_threads);
+	conn_set_stamp(conn, idle_now());
+	if (server_push(sv, start, conn))
+		return;
+	stats_get(sv)->full++;
+	/* another worker gets a queue of its own */
+	pool_grow(sv);
+	/* workers may sleep through what was queued before */
+	eventcount_notify(&sv->not_empty, sv->nr_threads);
+	if (sv->target) {
+		/* shed conn rather than holding up the caller */
+		if (!server_push(sv, start, conn)) {
+			stats_get(sv)->shed_full++;
+			conn_shed(conn);
+		}
+		return;
+	}
+	while (1) {
+		key = eventcount_prepare(&sv->not_full);
+		if (server_push(sv, start, conn)) {
+			eventcount_cancel(&sv->not_full);
+			break;
+		}
+		eventcount_wait(&sv->not_full, key, -1);
+	}
+}
+
+/* serve requests on conn, which has one ready */
+static void
+server_dispatch(struct server *sv, struct conn *conn)
+{
+	if (sv->nr_threads == 0) { /* no worker threads */
+		do_server_conn(sv, conn);
+		return;
+	}
+	server_queue(sv, conn);
+	eventcount_notify(&sv->not_empty, 1);
+}
+
+/* waits for idle connections to send their next request or time out */
+static void *
+idle_thread(void *arg)
+{
+	struct server *sv = (struct server *)arg;
+	struct idle *idle = sv->idle;
+	struct epoll_event events[IDLE_EVENTS];
+	struct conn *conn;
+	uint64_t count;
+	long now;
+	int i, n, timeout;
+
+	while (1) {
+		pthread_mutex_lock(&idle->lock);
+		timeout = -1;
+		if (idle->head >= 0) {
+			timeout = idle->conns[idle->head].since + idle->timeout -
+				idle_now();
+			if (timeout < 0)
+				timeout = 0;
+		}
+		pthread_mutex_unlock(&idle->lock);
+		n = epoll_wait(idle->epfd, events, IDLE_EVENTS, timeout);
+		if (n < 0 && errno != EINTR) {
+			perror("epoll_wait");
+			exit(1);
+		}
+		for (i = 0; i < n; i++) {
+			if (events[i].data.fd == idle->wakefd) {
+				SYS(read(idle->wakefd, &count, sizeof(count)));
+				continue;
+			}
+			pthread_mutex_lock(&idle->lock);
+			conn = idle_unpark(idle, events[i].data.fd);
+			pthread_mutex_unlock(&idle->lock);
+			if (conn) {
+				server_dispatch(sv, conn);
+			}
+		}
+		pthread_mutex_lock(&idle->lock);
+		if (idle->exiting) {
+			pthread_mutex_unlock(&idle->lock);
+			break;
+		}
+		now = idle_now();
+		while (idle->head >= 0 &&
+		       now - idle->conns[idle->head].since >= idle->timeout) {
+			conn_destroy(idle_unpark(idle, idle->head));
+			stats_get(sv)->timed_out++;
+		}
+		pthread_mutex_unlock(&idle->lock);
+	}
+	return NULL;
+}
+
+static struct idle *
+idle_init(struct server *sv, int timeout)
+{
+	struct idle *idle;
+	struct rlimit rl;
+	struct epoll_event ev = { .events = EPOLLIN };
+	pthread_attr_t attr;
+	int i;
+
+	idle = Malloc(sizeof(struct idle));
+	pthread_mutex_init(&idle->lock, NULL);
+	SYS(idle->epfd = epoll_create1(0));
+	SYS(idle->wakefd = eventfd(0, 0));
+	ev.data.fd = idle->wakefd;
+	SYS(epoll_ctl(idle->epfd, EPOLL_CTL_ADD, idle->wakefd, &ev));
+	idle->timeout = timeout;
+	idle->exiting = 0;
+	/* connections are indexed by fd, and no fd is above the limit */
+	SYS(getrlimit(RLIMIT_NOFILE, &rl));
+	idle->nr_fds = rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > 1 << 20 ?
+		1 << 20 : rl.rlim_cur;
+	idle->conns = Malloc(sizeof(struct idle_conn) * idle->nr_fds);
+	for (i = 0; i < idle->nr_fds; i++) {
+		idle->conns[i].conn = NULL;
+	}
+	idle->head = -1;
+	idle->tail = -1;
+	/* it hands connections to the workers, like the acceptor. the thread
+	 * finds idle through sv, so it must be set before it starts. */
+	sv->idle = idle;
+	server_attr(sv, &attr, -1);
+	SYS(pthread_create(&idle->thread, &attr, idle_thread, sv));
+	SYS(pthread_attr_destroy(&attr));
+	return idle;
+}
+
+/* stop the idle thread, and close the connections that are waiting. from now
+ * on, connections are closed instead of waiting. */
+static void
+idle_stop(struct idle *idle)
+{
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&idle->lock);
+	idle->exiting = 1;
+	pthread_mutex_unlock(&idle->lock);
+	SYS(write(idle->wakefd, &one, sizeof(one)));
+	pthread_join(idle->thread, NULL);
+	pthread_mutex_lock(&idle->lock);
+	while (idle->head >= 0) {
+		conn_destroy(idle_unpark(idle, idle->head));
+	}
+	pthread_mutex_unlock(&idle->lock);
+}
+
+static void
+idle_destroy(struct idle *idle)
+{
+	SYS(close(idle->epfd));
+	SYS(close(idle->wakefd));
+	pthread_mutex_destroy(&idle->lock);
+	free(idle->conns);
+	free(idle);
+}
+
+/* returns a new connection of an event loop on connfd, whose conn is set up
+ * by the loop */
+static struct econn *
+econn_init(int connfd)
+{
+	struct econn *ec;
+
+	ec = Malloc(sizeof(struct econn));
+	ec->fd = connfd;
+	ec->conn = NULL;
+	ec->reply.rq = NULL;
+	ec->inflight = 0;
+	ec->failed = 0;
+	ec->closing = 0;
+	ec->slot = -1;
+	ec->pipe[0] = -1;
+	ec->pipe[1] = -1;
+	ec->in_pipe = 0;
+	memset(&ec->msg, 0, sizeof(ec->msg));
+	return ec;
+}
+
+/* ec made progress just now, which moves it to the end of the loop's list */
+static void
+loop_touch(struct loop *loop, struct econn *ec)
+{
+	if (loop->tail != ec) {
+		if (ec->prev) {
+			ec->prev->next = ec->next;
+		} else {
+			loop->head = ec->next;
+		}
+		ec->next->prev = ec->prev;
+		ec->prev = loop->tail;
+		ec->next = NULL;
+		loop->tail->next = ec;
+		loop->tail = ec;
+	}
+	ec->since = idle_now();
+}
+
+/* take ec off the loop's list */
+static void
+loop_unlink(struct loop *loop, struct econn *ec)
+{
+	if (ec->prev) {
+		ec->prev->next = ec->next;
+	} else {
+		loop->head = ec->next;
+	}
+	if (ec->next) {
+		ec->next->prev = ec->prev;
+	} else {
+		loop->tail = ec->prev;
+	}
+}
+
+/* close ec, giving up on the response being sent */
+static void
+loop_close(struct loop *loop, struct econn *ec)
+{
+	loop_unlink(loop, ec);
+	if (ec->reply.rq) {
+		reply_done(&ec->reply);
+	}
+	/* closing the socket removes it from epoll */
+	conn_destroy(ec->conn);
+	free(ec);
+}
 
-    if(key < 0)
-        key *= -1;
+/* returns the connections handed over to the loop since the last call */
+static struct econn *
+loop_incoming(struct loop *loop)
+{
+	struct econn *ec;
 
-    key %= 20101;
-    
-    return key;
+	pthread_mutex_lock(&loop->lock);
+	ec = loop->incoming;
+	loop->incoming = NULL;
+	pthread_mutex_unlock(&loop->lock);
+	return ec;
 }
 
-struct server {
-	int nr_threads;
-	int max_requests;
-	int max_cache_size;
-	int exiting;
-	/* add any other parameters you need */
-	int *conn_buf;
-	pthread_t *threads;
-	int request_head;
-	int request_tail;
-	pthread_mutex_t mutex;
-	pthread_cond_t prod_cond;
-	pthread_cond_t cons_cond;	
-};
+/* add ec to the end of the loop's list */
+static void
+loop_append(struct loop *loop, struct econn *ec)
+{
+	ec->since = idle_now();
+	ec->prev = loop->tail;
+	ec->next = NULL;
+	if (loop->tail) {
+		loop->tail->next = ec;
+	} else {
+		loop->head = ec;
+	}
+	loop->tail = ec;
+}
 
-/* static functions */
+/* start watching ec, at the end of the loop's list */
+static void
+loop_adopt(struct loop *loop, struct econn *ec)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+		.data.ptr = ec,
+	};
 
-/* initialize file data */
-static struct file_data *
-file_data_init(void)
+	loop_append(loop, ec);
+	SYS(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, conn_fd(ec->conn), &ev));
+}
+
+/* start watching the connections handed over to the loop. they may have a
+ * request ready already, in which case epoll reports them right away. */
+static void
+loop_watch(struct loop *loop)
 {
-	struct file_data *data;
+	struct econn *ec, *next;
 
-	data = Malloc(sizeof(struct file_data));
-	data->file_name = NULL;
-	data->file_buf = NULL;
-	data->file_size = 0;
-	return data;
+	for (ec = loop_incoming(loop); ec; ec = next) {
+		next = ec->next;
+		ec->conn = conn_init(ec->fd, loop->sv->keep_alive);
+		loop_adopt(loop, ec);
+	}
 }
 
-/* free all file data */
+/* accept the connections waiting on the loop's listening socket */
 static void
-file_data_free(struct file_data *data)
+loop_accept(struct loop *loop)
+{
+	struct econn *ec;
+	int connfd;
+
+	while ((connfd = accept4(loop->listenfd, NULL, NULL,
+				 SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		stats_get(loop->sv)->connections++;
+		ec = econn_init(connfd);
+		ec->conn = conn_init(connfd, loop->sv->keep_alive);
+		loop_adopt(loop, ec);
+	}
+	/* out of descriptors, the level-triggered socket would be reported
+	 * again right away, so it is left alone for a while */
+	if (errno == EMFILE || errno == ENFILE) {
+		struct epoll_event ev = { .events = 0,
+					  .data.ptr = &loop->listenfd };
+
+		SYS(epoll_ctl(loop->epfd, EPOLL_CTL_MOD, loop->listenfd, &ev));
+		loop->accept_paused = idle_now();
+		return;
+	}
+	/* the socket is level-triggered, so what is left is reported again */
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED &&
+	    errno != EINTR) {
+		perror("accept4");
+		exit(1);
+	}
+}
+
+/* watch the listening socket of the loop again, once the backoff is over */
+static void
+loop_accept_resume(struct loop *loop, long now)
+{
+	struct epoll_event ev = { .events = EPOLLIN,
+				  .data.ptr = &loop->listenfd };
+
+	if (!loop->accept_paused || now - loop->accept_paused < ACCEPT_BACKOFF)
+		return;
+	SYS(epoll_ctl(loop->epfd, EPOLL_CTL_MOD, loop->listenfd, &ev));
+	loop->accept_paused = 0;
+}
+
+/* returns the loop that the file at uri belongs to */
+static int
+loop_owner(struct server *sv, const char *uri, int len)
+{
+	unsigned int hash = 2166136261u;	/* FNV-1a */
+	int i;
+
+	for (i = 0; i < len; i++) {
+		hash = (hash ^ (unsigned char)uri[i]) * 16777619u;
+	}
+	return hash % sv->nr_loops;
+}
+
+/* the request on ec has arrived. move ec to the loop that owns the file it
+ * requests, unless that is this loop. returns 0 if ec stays here, also when
+ * the queue to the other loop is full. */
+static int
+loop_forward(struct loop *loop, struct econn *ec)
 {
-	free(data->file_name);
-	free(data->file_buf);
-	free(data);
-}
-
-// Global hash table
-struct hash_table *hash_brown;
-
-// Evict cache for insert
-void cache_evict(int space_required){
-    
-    // Keep evicting until the new entry can be inserted
-    while(space_required > 0){
-        
-        // Remove from cache and update spaces
-        struct node* die = hash_brown -> LRU_cache;
-        hash_brown -> LRU_cache = hash_brown -> LRU_cache -> next;
-        die -> next = NULL;
-        
-        space_required -= die -> file -> file_size;
-        hash_brown -> cache_space_available += die -> file -> file_size;
-        
-        // Remove from hash table
-        unsigned long key = hash(die -> file -> file_name);
-        struct node* cur = hash_brown -> ht[key];
-        struct node* pre = cur;
-        
-        while(strcmp(cur -> file -> file_name, die -> file -> file_name) != 0){
-            pre = cur;
-            cur = cur -> next;
-        }
-        
-        pre -> next = cur ->next;
-        cur -> next = NULL;
-        
-        // Set the index to null if evicted node is the only one at it
-        if(hash_brown -> ht[key] -> next == NULL)
-            hash_brown -> ht[key] = NULL;
-        
-        // Free the memory
-        file_data_free(cur -> file);
-        free(cur);
-        file_data_free(die -> file);
-        free(die);
-    }
-    
-    return;
-}
-
-// Insert file at the tail of the cache if it is not already in the cache
-// head = least recently used, tail = most recently used
-void cache_insert(struct file_data* file){
-    
-    // Get some free space in cache if there's not enough
-    if(hash_brown -> cache_space_available < file -> file_size)
-        cache_evict(file -> file_size - hash_brown -> cache_space_available);
-    
-    // Insert cache
-    struct node *new_cache_entry = Malloc(sizeof(struct node));
-    new_cache_entry -> file = file_data_init();
-    new_cache_entry -> file -> file_buf = strdup(file -> file_buf);
-    new_cache_entry -> file -> file_name = strdup(file -> file_name);
-    new_cache_entry -> file -> file_size = file -> file_size;
-    // new_cache_entry -> file = file;
-    new_cache_entry -> next = NULL;
-    
-    // Cache is empty
-    if(hash_brown -> LRU_cache == NULL)
-        hash_brown -> LRU_cache = new_cache_entry;
-    
-    // Cache is not empty
-    else{
-        struct node * cur = hash_brown -> LRU_cache;
-        
-        // Find the last entry in the cache
-        while(cur -> next != NULL)
-            cur = cur -> next;
-        
-        cur -> next = new_cache_entry;
-    }
-    
-    // Insert hash table
-    struct node *new_ht_entry = Malloc(sizeof(struct node));
-    new_ht_entry -> file = file_data_init();
-    new_ht_entry -> file -> file_buf = strdup(file -> file_buf);
-    new_ht_entry -> file -> file_name = strdup(file -> file_name);
-    new_ht_entry -> file -> file_size = file -> file_size;
-    //new_ht_entry -> file = file;
-    new_ht_entry -> next = NULL;
-    unsigned long key = hash(file -> file_name);
-    
-    // Index is empty
-    if(hash_brown -> ht[key] == NULL)
-        hash_brown -> ht[key] = new_ht_entry;
-    
-    // Index is not empty
-    else{
-        struct node * cur = hash_brown -> ht[key];
-        
-        // Find the last node at the index
-        while(cur -> next != NULL)
-            cur = cur -> next;
-        
-        cur -> next = new_ht_entry;
-    }
-    
-    // Update cache space
-    hash_brown -> cache_space_available -= file -> file_size;
-    
-    return;
-}
-
-// Check if a file is in the cache
-// Cache content = hash table content
-struct file_data* cache_lookup(struct file_data* file){
-    
-    unsigned long key = hash(file -> file_name);
-    struct node *cur = hash_brown -> ht[key];
-    
-    while(cur != NULL){
-        // file is in the cache
-        if(strcmp(cur -> file -> file_name, file -> file_name) == 0)
-            return cur -> file;
-    }
-    
-    // file is not in the cache
-    return NULL;
-}
-
-// If a file in the cache is accessed, move it to the tail making it most recently used
-void cache_update(struct file_data* file){
-    
-    // If only one file in the cache
-    if(hash_brown -> LRU_cache -> next == NULL)
-        return;
-    
-    struct node *cur = hash_brown -> LRU_cache;
-    struct node *pre = cur;
-    
-    // Look for the file
-    while(cur != NULL){
-        
-        if(strcmp(cur -> file -> file_name, file -> file_name) == 0)
-            break;
-        
-        pre = cur;
-        cur = cur -> next;
-    }
-    
-    // File is at the head
-    if(strcmp(cur -> file -> file_name, hash_brown -> LRU_cache -> file -> file_name) == 0)
-        hash_brown -> LRU_cache = hash_brown -> LRU_cache -> next;
-    
-    // Otherwise
-    else
-        pre -> next = cur -> next;
-    
-    // Put it at the tail
-    cur -> next = NULL;
-    struct node *tail = hash_brown -> LRU_cache;
-    
-    while(tail -> next != NULL)
-        tail = tail -> next;
-    
-    tail -> next = cur;
-    
-    return;
-}
-
-static void
-do_server_request(struct server *sv, int connfd)
+	struct server *sv = loop->sv;
+	const char *uri;
+	uint64_t one = 1;
+	int len, owner;
+
+	uri = conn_uri(ec->conn, &len);
+	if (!uri)
+		return 0;
+	owner = loop_owner(sv, uri, len);
+	if (&sv->loops[owner] == loop)
+		return 0;
+	/* the other loop may serve ec as soon as it is queued */
+	loop_unlink(loop, ec);
+	SYS(epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn_fd(ec->conn), NULL));
+	if (!spsc_push(loop->forward[owner], ec)) {
+		loop_adopt(loop, ec);
+		return 0;
+	}
+	SYS(write(sv->loops[owner].wakefd, &one, sizeof(one)));
+	stats_get(sv)->forwarded++;
+	return 1;
+}
+
+/* make as much progress on ec as its socket allows: finish sending the
+ * response, then serve the requests that have arrived, until the socket has
+ * nothing to read or can't take more. edge-triggered epoll only reports ec
+ * again once that changes. */
+static void
+loop_serve(struct loop *loop, struct econn *ec)
 {
+	struct server *sv = loop->sv;
 	int ret;
-	struct request *rq;
-	struct file_data *data;
 
-	data = file_data_init();
+	loop_touch(loop, ec);
+	while (1) {
+		if (ec->reply.rq) {
+			ret = request_flush(ec->reply.rq);
+			if (ret == 0) {
+				stats_get(sv)->stalled++;
+				return;
+			}
+			if (ret < 0 || !request_keep_alive(ec->reply.rq)) {
+				loop_close(loop, ec);
+				return;
+			}
+			reply_done(&ec->reply);
+		}
+		/* wait for a whole request, or a malformed one */
+		while (conn_parse(ec->conn) == 0) {
+			ret = conn_fill(ec->conn);
+			if (ret < 0 && errno == EAGAIN)
+				return;
+			if (ret <= 0) {
+				loop_close(loop, ec);
+				return;
+			}
+		}
+		if (loop->forward && loop_forward(loop, ec))
+			return;
+		if (!server_handle(sv, ec->conn, &ec->reply, 0)) {
+			loop_close(loop, ec);
+			return;
+		}
+	}
+}
+
+/* serve the connections the other loops moved to this one. their requests
+ * have arrived already. */
+static void
+loop_moved(struct loop *loop)
+{
+	struct server *sv = loop->sv;
+	struct econn *ec;
+	int i, self = loop - sv->loops;
 
-	/* fill data->file_name with name of the file being requested */
-	rq = request_init(connfd, data);
-	if (!rq) {
-		file_data_free(data);
+	for (i = 0; i < sv->nr_loops; i++) {
+		while ((ec = spsc_pop(sv->loops[i].forward[self]))) {
+			loop_adopt(loop, ec);
+			loop_serve(loop, ec);
+		}
+	}
+}
+
+static void *
+loop_thread(void *arg)
+{
+	struct loop *loop = (struct loop *)arg;
+	struct epoll_event events[LOOP_EVENTS];
+	uint64_t count;
+	long now, resume;
+	int i, n, timeout, exiting;
+
+	thread_cache = loop->cache;
+	while (1) {
+		timeout = -1;
+		if (loop->head) {
+			timeout = loop->head->since + loop->sv->timeout -
+				idle_now();
+			if (timeout < 0)
+				timeout = 0;
+		}
+		/* wake up to watch the listening socket again */
+		if (loop->accept_paused) {
+			resume = loop->accept_paused + ACCEPT_BACKOFF -
+				idle_now();
+			if (resume < 0)
+				resume = 0;
+			if (timeout < 0 || resume < timeout)
+				timeout = resume;
+		}
+		n = epoll_wait(loop->epfd, events, LOOP_EVENTS, timeout);
+		if (n < 0 && errno != EINTR) {
+			perror("epoll_wait");
+			exit(1);
+		}
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == NULL) { /* woken up */
+				SYS(read(loop->wakefd, &count, sizeof(count)));
+				loop_watch(loop);
+				if (loop->forward) {
+					loop_moved(loop);
+				}
+			} else if (events[i].data.ptr == &loop->listenfd) {
+				loop_accept(loop);
+			} else {
+				loop_serve(loop, events[i].data.ptr);
+			}
+		}
+		pthread_mutex_lock(&loop->lock);
+		exiting = loop->exiting;
+		pthread_mutex_unlock(&loop->lock);
+		if (exiting)
+			break;
+		now = idle_now();
+		while (loop->head &&
+		       now - loop->head->since >= loop->sv->timeout) {
+			loop_close(loop, loop->head);
+			stats_get(loop->sv)->timed_out++;
+		}
+		loop_accept_resume(loop, now);
+	}
+	/* connections handed over since the last wakeup are closed, too */
+	loop_watch(loop);
+	while (loop->head) {
+		loop_close(loop, loop->head);
+	}
+	return NULL;
+}
+
+/* read more of the request on ec */
+static void
+ring_recv(struct loop *loop, struct econn *ec)
+{
+	struct io_uring_sqe *sqe;
+	unsigned long long data = (unsigned long)ec | RING_RECV;
+	char *space;
+	int len;
+
+	/* the parser fails requests that fill up the buffer */
+	space = conn_space(ec->conn, &len);
+	assert(space);
+	if (ec->slot >= 0) {
+		sqe = uring_prep(loop->ur, IORING_OP_READ_FIXED, ec->fd, space,
+				 len, 0, data);
+		sqe->buf_index = 0;
+	} else {
+		uring_prep(loop->ur, IORING_OP_RECV, ec->fd, space, len, 0,
+			   data);
+	}
+	ec->inflight++;
+}
+
+/* send what is left of the response on ec. the pieces in memory go out with
+ * one sendmsg, linked to splicing the first part of the file, if there is
+ * one, into the connection's pipe and on to the socket. returns 0 if the
+ * response has been sent. */
+static int
+ring_send(struct loop *loop, struct econn *ec)
+{
+	struct request *rq = ec->reply.rq;
+	struct io_uring_sqe *sqe;
+	struct iovec *iov;
+	unsigned long long data = (unsigned long)ec;
+	int iovcnt, file;
+	off_t off;
+	size_t len;
+
+	iovcnt = request_unsent(rq, &iov);
+	file = request_unsent_file(rq, &off, &len);
+	if (iovcnt == 0 && file < 0 && ec->in_pipe == 0)
+		return 0;
+	if (iovcnt > 0) {
+		ec->msg.msg_iov = iov;
+		ec->msg.msg_iovlen = iovcnt;
+		sqe = uring_prep(loop->ur, IORING_OP_SENDMSG, ec->fd, &ec->msg,
+				 1, 0, data | RING_SEND);
+		/* a short send would break the link */
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL |
+			(file >= 0 ? MSG_MORE : 0);
+		ec->inflight++;
+		if (file < 0)
+			return 1;
+		sqe->flags = IOSQE_IO_LINK;
+	}
+	if (ec->in_pipe > 0) {
+		/* what didn't make it out of the pipe last time */
+		sqe = uring_prep(loop->ur, IORING_OP_SPLICE, ec->fd, NULL,
+				 ec->in_pipe, -1, data | RING_SPLICE_OUT);
+		sqe->splice_fd_in = ec->pipe[0];
+		sqe->splice_off_in = -1;
+		ec->inflight++;
+		return 1;
+	}
+	if (ec->pipe[0] < 0) {
+		SYS(pipe(ec->pipe));
+	}
+	if (len > RING_SPLICE) {
+		len = RING_SPLICE;
+	}
+	sqe = uring_prep(loop->ur, IORING_OP_SPLICE, ec->pipe[1], NULL, len,
+			 -1, data | RING_SPLICE_IN);
+	sqe->splice_fd_in = file;
+	sqe->splice_off_in = off;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe = uring_prep(loop->ur, IORING_OP_SPLICE, ec->fd, NULL, len, -1,
+			 data | RING_SPLICE_OUT);
+	sqe->splice_fd_in = ec->pipe[0];
+	sqe->splice_off_in = -1;
+	ec->inflight += 2;
+	return 1;
+}
+
+/* free ec, whose operations have all completed */
+static void
+ring_free(struct loop *loop, struct econn *ec)
+{
+	if (ec->closing) {
+		loop->nr_closing--;
+	}
+	if (ec->reply.rq) {
+		reply_done(&ec->reply);
+	}
+	if (ec->pipe[0] >= 0) {
+		SYS(close(ec->pipe[0]));
+		SYS(close(ec->pipe[1]));
+	}
+	conn_destroy(ec->conn);
+	if (ec->slot >= 0) {
+		loop->free_slots[loop->nr_free_slots++] = ec->slot;
+	}
+	free(ec);
+}
+
+/* close ec. operations that are still running on the socket are cut short by
+ * shutting it down, and ec is freed once they have completed. */
+static void
+ring_close(struct loop *loop, struct econn *ec)
+{
+	loop_unlink(loop, ec);
+	if (ec->inflight == 0) {
+		ring_free(loop, ec);
 		return;
 	}
-        
-        // See if file is in cache if it can fit
-        struct file_data* file_in_cache = NULL;
-        
-        pthread_mutex_lock(hash_brown -> lock);
-        
-        if(data -> file_size <= sv -> max_cache_size){
-            file_in_cache = cache_lookup(data);
-            if(file_in_cache != NULL)
-                cache_update(file_in_cache);
-        }
-            
-        pthread_mutex_unlock(hash_brown -> lock);
-        
-        // Send the file if found in cache
-        if(file_in_cache != NULL){
-            request_set_data(rq, file_in_cache);
-            request_sendfile(rq);
-        }
-        
-        // Otherwise, read from disk
-        else{
-            /* read file, 
-             * fills data->file_buf with the file contents,
-             * data->file_size with file size. */
-            ret = request_readfile(rq);
-            if (ret == 0) { /* couldn't read file */
-                    goto out;
-            }
-            /* send file to client */
-            request_sendfile(rq);
-            
-            // Cache the file if the file size is less than the cache size
-            pthread_mutex_lock(hash_brown -> lock);
-            
-            if(data -> file_size <= sv -> max_cache_size){
-                if(cache_lookup(data) == NULL)
-                    cache_insert(data);
-            }
-
-            pthread_mutex_unlock(hash_brown -> lock);
-        }
-out:
-	request_destroy(rq);
+	ec->closing = 1;
+	loop->nr_closing++;
+	shutdown(ec->fd, SHUT_RDWR);
+}
+
+/* ec has no operations running: send the rest of the response, then serve the
+ * requests that have arrived, until it has to wait for the client */
+static void
+ring_serve(struct loop *loop, struct econn *ec)
+{
+	while (1) {
+		if (ec->reply.rq) {
+			if (ring_send(loop, ec))
+				return;
+			if (!request_keep_alive(ec->reply.rq)) {
+				ring_close(loop, ec);
+				return;
+			}
+			reply_done(&ec->reply);
+		}
+		if (conn_parse(ec->conn) == 0) {
+			ring_recv(loop, ec);
+			return;
+		}
+		if (!server_handle(loop->sv, ec->conn, &ec->reply, 0)) {
+			ring_close(loop, ec);
+			return;
+		}
+	}
+}
 
-        // Having this line is problematic
-	file_data_free(data);
+/* an operation on ec has completed with res */
+static void
+ring_complete(struct loop *loop, struct econn *ec, int op, int res)
+{
+	ec->inflight--;
+	if (ec->closing) {
+		if (ec->inflight == 0) {
+			ring_free(loop, ec);
+		}
+		return;
+	}
+	/* operations linked to one that failed are cancelled */
+	if (res == -ECANCELED) {
+		res = 0;
+	} else if (res <= 0) {
+		ec->failed = 1;
+	} else if (op == RING_RECV) {
+		conn_filled(ec->conn, res);
+	} else if (op == RING_SEND) {
+		request_sent(ec->reply.rq, res);
+	} else if (op == RING_SPLICE_IN) {
+		request_sent_file(ec->reply.rq, res);
+		ec->in_pipe += res;
+	} else {
+		ec->in_pipe -= res;
+	}
+	/* a client that is slow but keeps up isn't timed out, even while a
+	 * chain of operations on it is still running */
+	if (res > 0) {
+		loop_touch(loop, ec);
+	}
+	if (ec->inflight > 0)
+		return;
+	if (ec->failed) {
+		ring_close(loop, ec);
+	} else {
+		ring_serve(loop, ec);
+	}
+}
+
+/* wait for the main thread to hand over connections */
+static void
+ring_wait(struct loop *loop)
+{
+	uring_prep(loop->ur, IORING_OP_READ, loop->wakefd, &loop->wake,
+		   sizeof(loop->wake), 0, 0);
+}
+
+/* set up the connections handed over to the loop, and start reading their
+ * first requests. their conns are placed in registered slots while there are
+ * free ones. */
+static void
+ring_watch(struct loop *loop)
+{
+	struct econn *ec, *next;
+	int keep_alive = loop->sv->keep_alive;
+	void *mem;
+
+	for (ec = loop_incoming(loop); ec; ec = next) {
+		next = ec->next;
+		if (loop->nr_free_slots > 0) {
+			ec->slot = loop->free_slots[--loop->nr_free_slots];
+			mem = loop->slots + ec->slot * conn_size();
+			ec->conn = conn_init_at(mem, ec->fd, keep_alive);
+		} else {
+			ec->conn = conn_init(ec->fd, keep_alive);
+		}
+		loop_append(loop, ec);
+		ring_recv(loop, ec);
+	}
+}
+
+/* handle the completions on the loop's ring */
+static void
+ring_reap(struct loop *loop)
+{
+	struct io_uring_cqe *cqe;
+	unsigned long long data;
+	int res;
+
+	while ((cqe = uring_peek(loop->ur))) {
+		data = cqe->user_data;
+		res = cqe->res;
+		uring_seen(loop->ur);
+		if (data == 0) {
+			ring_watch(loop);
+			ring_wait(loop);
+			continue;
+		}
+		ring_complete(loop, (struct econn *)(unsigned long)
+			      (data & ~RING_OPS), data & RING_OPS, res);
+	}
 }
 
+/* an event loop on io_uring. a connection always has one operation running,
+ * or a chain of them, until it is closed. */
 static void *
-do_server_thread(void *arg)
+ring_thread(void *arg)
 {
-	struct server *sv = (struct server *)arg;
-	int connfd;
+	struct loop *loop = (struct loop *)arg;
+	struct stats *stats = stats_get(loop->sv);
+	long now;
+	int timeout, exiting;
 
+	thread_files = loop->files;
+	ring_wait(loop);
 	while (1) {
-		pthread_mutex_lock(&sv->mutex);
-		while (sv->request_head == sv->request_tail) {
-			/* buffer is empty */
-			if (sv->exiting) {
-				pthread_mutex_unlock(&sv->mutex);
-				goto out;
-			}
-			pthread_cond_wait(&sv->cons_cond, &sv->mutex);
-		}
-		/* get request from tail */
-		connfd = sv->conn_buf[sv->request_tail];
-		/* consume request */
-		sv->conn_buf[sv->request_tail] = -1;
-		sv->request_tail = (sv->request_tail + 1) % sv->max_requests;
-		
-		pthread_cond_signal(&sv->prod_cond);
-		pthread_mutex_unlock(&sv->mutex);
-		/* now serve request */
-		do_server_request(sv, connfd);
+		timeout = -1;
+		if (loop->head) {
+			timeout = loop->head->since + loop->sv->timeout -
+				idle_now();
+			if (timeout < 0)
+				timeout = 0;
+		}
+		uring_enter(loop->ur, 1, timeout);
+		ring_reap(loop);
+		pthread_mutex_lock(&loop->lock);
+		exiting = loop->exiting;
+		pthread_mutex_unlock(&loop->lock);
+		if (exiting)
+			break;
+		now = idle_now();
+		while (loop->head &&
+		       now - loop->head->since >= loop->sv->timeout) {
+			ring_close(loop, loop->head);
+			stats->timed_out++;
+		}
 	}
-out:
+	ring_watch(loop);
+	while (loop->head) {
+		ring_close(loop, loop->head);
+	}
+	while (loop->nr_closing > 0) {
+		uring_enter(loop->ur, 1, -1);
+		ring_reap(loop);
+	}
+	stats->uring_enters += uring_nr_enters(loop->ur) +
+		uring_nr_enters(loop->files);
 	return NULL;
 }
 
+/* set up io_uring for the loop. returns 0 if it is not available. */
+static int
+ring_init(struct loop *loop)
+{
+	int i;
+
+	loop->ur = uring_init(RING_ENTRIES);
+	if (!loop->ur)
+		return 0;
+	/* files are read into one fixed file slot, see request_read_uring */
+	loop->files = uring_init(8);
+	if (!loop->files || uring_register_files(loop->files, 1) < 0) {
+		if (loop->files) {
+			uring_destroy(loop->files);
+		}
+		uring_destroy(loop->ur);
+		loop->ur = NULL;
+		return 0;
+	}
+	loop->slots = Malloc_aligned(getpagesize(), RING_SLOTS * conn_size());
+	loop->free_slots = Malloc(sizeof(int) * RING_SLOTS);
+	loop->nr_free_slots = 0;
+	/* without registered buffers, connections are read with recv */
+	if (uring_register_buffer(loop->ur, loop->slots,
+				  RING_SLOTS * conn_size()) == 0) {
+		for (i = RING_SLOTS - 1; i >= 0; i--) {
+			loop->free_slots[loop->nr_free_slots++] = i;
+		}
+	}
+	return 1;
+}
+
+/* start an event loop, on io_uring if uring is set and it is available.
+ * returns 0 if the loop uses epoll instead. */
+static int
+loop_init(struct server *sv, struct loop *loop, int uring,
+	  struct cache *cache)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+	pthread_attr_t attr;
+	int ring = 0, i;
+
+	loop->sv = sv;
+	SYS(loop->wakefd = eventfd(0, 0));
+	pthread_mutex_init(&loop->lock, NULL);
+	loop->incoming = NULL;
+	loop->exiting = 0;
+	loop->head = NULL;
+	loop->tail = NULL;
+	loop->nr_closing = 0;
+	loop->epfd = -1;
+	loop->ur = NULL;
+	loop->files = NULL;
+	loop->slots = NULL;
+	loop->free_slots = NULL;
+	loop->listenfd = -1;
+	loop->accept_paused = 0;
+	loop->cache = cache;
+	loop->forward = NULL;
+	if (sv->partitioned) {
+		loop->forward = Malloc(sizeof(struct spsc *) * sv->nr_loops);
+		for (i = 0; i < sv->nr_loops; i++) {
+			loop->forward[i] = spsc_init(FORWARD_SLOTS);
+		}
+	}
+	server_attr(sv, &attr, loop - sv->loops);
+	if (uring && ring_init(loop)) {
+		SYS(pthread_create(&loop->thread, &attr, ring_thread, loop));
+		ring = 1;
+	} else {
+		SYS(loop->epfd = epoll_create1(0));
+		SYS(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev));
+		SYS(pthread_create(&loop->thread, &attr, loop_thread, loop));
+	}
+	SYS(pthread_attr_destroy(&attr));
+	return ring;
+}
+
+/* hand connfd to the event loop on the cpu that received it, or else to the
+ * next one, round robin */
+static void
+loop_add(struct server *sv, int connfd)
+{
+	struct loop *loop;
+	struct econn *ec;
+	uint64_t one = 1;
+	int flags;
+
+	loop = &sv->loops[server_steer(sv, connfd, &sv->next_loop,
+				       sv->nr_loops) % sv->nr_loops];
+	if (!loop->ur) {
+		SYS(flags = fcntl(connfd, F_GETFL));
+		SYS(fcntl(connfd, F_SETFL, flags | O_NONBLOCK));
+	}
+	ec = econn_init(connfd);
+	pthread_mutex_lock(&loop->lock);
+	ec->next = loop->incoming;
+	loop->incoming = ec;
+	pthread_mutex_unlock(&loop->lock);
+	SYS(write(loop->wakefd, &one, sizeof(one)));
+}
+
+/* stop the loop, which closes its connections */
+static void
+loop_stop(struct loop *loop)
+{
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&loop->lock);
+	loop->exiting = 1;
+	pthread_mutex_unlock(&loop->lock);
+	SYS(write(loop->wakefd, &one, sizeof(one)));
+	pthread_join(loop->thread, NULL);
+}
+
+static void
+loop_destroy(struct loop *loop)
+{
+	struct econn *ec;
+	int i;
+
+	if (loop->ur) {
+		/* this cancels the read of wakefd */
+		uring_destroy(loop->ur);
+		uring_destroy(loop->files);
+		free(loop->slots);
+		free(loop->free_slots);
+	} else {
+		SYS(close(loop->epfd));
+	}
+	SYS(close(loop->wakefd));
+	pthread_mutex_destroy(&loop->lock);
+	if (loop->listenfd >= 0) {
+		SYS(close(loop->listenfd));
+	}
+	if (loop->cache) {
+		cache_destroy(loop->cache);
+	}
+	/* connections moved to a loop after it stopped are still queued */
+	for (i = 0; loop->forward && i < loop->sv->nr_loops; i++) {
+		while ((ec = spsc_pop(loop->forward[i]))) {
+			conn_destroy(ec->conn);
+			free(ec);
+		}
+		spsc_destroy(loop->forward[i]);
+	}
+	free(loop->forward);
+}
+
 /* entry point functions */
 
 struct server *
-server_init(int nr_threads, int max_requests, int max_cache_size)
+server_init(int nr_threads, int max_requests, int max_cache_size,
+	    struct server_opts *opts)
 {
 	struct server *sv;
+	const struct cache_policy *policy = NULL;
 	int i;
 
 	sv = Malloc(sizeof(struct server));
 	sv->nr_threads = nr_threads;
-	/* we add 1 because we queue at most max_request - 1 requests */
-	sv->max_requests = max_requests + 1;
+	sv->max_requests = max_requests;
 	sv->max_cache_size = max_cache_size;
 	sv->exiting = 0;
 
-	/* Lab 4: create queue of max_request size when max_requests > 0 */
-	sv->conn_buf = Malloc(sizeof(*sv->conn_buf) * sv->max_requests);
-	for (i = 0; i < sv->max_requests; i++) {
-		sv->conn_buf[i] = -1;
-	}
-	sv->request_head = 0;
-	sv->request_tail = 0;
-
-	/* Lab 5: init server cache and limit its size to max_cache_size */
-        hash_brown = Malloc(sizeof(struct hash_table));
-        hash_brown -> cache_space_available = max_cache_size;
-        hash_brown -> LRU_cache = NULL;
-        hash_brown -> lock = Malloc(sizeof(pthread_mutex_t));
-        pthread_mutex_init(hash_brown -> lock, NULL);
-        for(int i = 0; i < 20101; i++)
-            hash_brown -> ht[i] = NULL;
-        
-	/* Lab 4: create worker threads when nr_threads > 0 */
-	pthread_mutex_init(&sv->mutex, NULL);
-	pthread_cond_init(&sv->prod_cond, NULL);
-	pthread_cond_init(&sv->cons_cond, NULL);	
-	sv->threads = Malloc(sizeof(pthread_t) * nr_threads);
+	/* Lab 4: the workers' queues are created with the workers below */
+	sv->next_worker = 0;
+	eventcount_init(&sv->not_empty);
+	eventcount_init(&sv->not_full);
+
+	/* Lab 5: init server cache and limit its size to max_cache_size.
+	 * with -x, the loops split it between them instead. */
+	sv->cache = NULL;
+	sv->partitioned = opts->partition;
+	sv->target = nr_threads > 0 && !opts->event ? opts->target : 0;
+	sv->codel_end = 0;
+	sv->codel_min = 0;
+	sv->overloaded = 0;
+	sv->sched = sched_init(opts->sched, nr_threads, max_requests);
+	if (nr_threads == 0 || opts->event) {
+		/* requests are served in the order they arrive */
+		if (sv->sched) {
+			sched_destroy(sv->sched);
+		}
+		sv->sched = NULL;
+	}
+	if (max_cache_size > 0) {
+		policy = cache_policy_find(opts->policy);
+		if (!policy) {
+			fprintf(stderr, "unknown cache policy: %s\n",
+				opts->policy);
+			exit(1);
+		}
+		if (opts->lockfree && !policy->lockless_hit) {
+			fprintf(stderr, "the %s cache policy can't be used "
+				"with lock-free lookups\n", policy->name);
+			exit(1);
+		}
+		if (!sv->partitioned) {
+			sv->cache = cache_init(max_cache_size, opts->nr_shards,
+					       opts->lockfree, policy,
+					       opts->admission, opts->arena);
+		}
+	}
+	sv->zerocopy = opts->zerocopy;
+	sv->csums = NULL;
+	if (opts->csums) {
+		sv->csums = csums_load(opts->csums);
+	}
+	pthread_mutex_init(&sv->stats_lock, NULL);
+	sv->stats = NULL;
+	sv->keep_alive = opts->keep_alive > 0;
+	sv->timeout = opts->keep_alive * 1000;
+	sv->idle = NULL;
+	/* the calling thread goes on to accept connections */
+	sv->cpus = NULL;
+	if (opts->cpus) {
+		sv->cpus = cpus_init(opts->cpus);
+		cpus_bind(server_cpu(sv, -1));
+	}
+	sv->loops = NULL;
+	sv->nr_loops = 0;
+	sv->next_loop = 0;
+	if (opts->event) {
+		/* the loops take the place of the workers and the idle
+		 * thread, and time out stuck connections too */
+		sv->nr_loops = nr_threads > 0 ? nr_threads : 1;
+		sv->loops = Malloc(sizeof(struct loop) * sv->nr_loops);
+		for (i = 0; i < sv->nr_loops; i++) {
+			struct cache *cache = NULL;
+
+			if (sv->partitioned && policy) {
+				cache = cache_init(max_cache_size / sv->nr_loops,
+						   1, opts->lockfree, policy,
+						   opts->admission, opts->arena);
+			}
+			/* loops that share nothing run on epoll */
+			if (!loop_init(sv, &sv->loops[i],
+				       opts->uring && !sv->partitioned, cache) &&
+			    opts->uring && !sv->partitioned && i == 0) {
+				fprintf(stderr, "io_uring is not available, "
+					"using epoll\n");
+			}
+		}
+		if (!sv->timeout) {
+			sv->timeout = LOOP_TIMEOUT;
+		}
+		sv->nr_threads = nr_threads = 0;
+	} else if (sv->keep_alive) {
+		sv->idle = idle_init(sv, sv->timeout);
+	}
+
+	/* Lab 4: create worker threads when nr_threads > 0. the queue of
+	 * max_requests connections is split between them. the pool can grow
+	 * up to max_threads workers, which are set up front, but only
+	 * started when they are needed. the queues are sized for the workers
+	 * that are always running, so that they alone hold max_requests
+	 * connections, and each worker that is started adds as much room as
+	 * one of them has. */
+	sv->min_threads = nr_threads;
+	if (nr_threads > 0 && opts->max_threads > nr_threads) {
+		sv->nr_threads = nr_threads = opts->max_threads;
+	}
+	sv->nr_active = sv->peak_threads = sv->min_threads;
+	sv->started = 0;
+	sv->retired = 0;
+	pthread_mutex_init(&sv->pool_lock, NULL);
+	sv->workers = Malloc(sizeof(struct worker) * nr_threads);
 	for (i = 0; i < nr_threads; i++) {
-		SYS(pthread_create(&(sv->threads[i]), NULL, do_server_thread,
-				   (void *)sv));
+		sv->workers[i].sv = sv;
+		sv->workers[i].id = i;
+		sv->workers[i].conns = queue_init((max_requests +
+						   sv->min_threads - 1) /
+						  sv->min_threads);
+		sv->workers[i].active = 0;
+		sv->workers[i].nr_batch = 0;
+		sv->workers[i].next_batch = 0;
+		sv->workers[i].started = 0;
+	}
+	for (i = 0; i < sv->min_threads; i++) {
+		worker_start(&sv->workers[i]);
+	}
+	if (sv->cpus) {
+		int n = sv->loops ? sv->nr_loops : nr_threads;
+
+		cpus_report(sv->cpus);
+		printf("pinned the acceptor to cpu %d", server_cpu(sv, -1));
+		if (n > 0) {
+			printf(", and the %s to cpus",
+			       sv->loops ? "event loops" : "workers");
+		}
+		/* the cpus repeat after the first cpus_count - 1 */
+		for (i = 0; i < n && (i == 0 || i < cpus_count(sv->cpus) - 1);
+		     i++) {
+			printf(" %d", server_cpu(sv, i));
+		}
+		printf("\n");
 	}
 	return sv;
 }
 
+/* returns the number of listening sockets the server accepts connections on
+ * itself, see server_listen */
+int
+server_listeners(struct server *sv)
+{
+	return sv->partitioned ? sv->nr_loops : 0;
+}
+
+/* hand a non-blocking listening socket to the next loop that has none */
+void
+server_listen(struct server *sv, int listenfd)
+{
+	struct loop *loop = &sv->loops[sv->next_loop++ % sv->nr_loops];
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = &loop->listenfd,
+	};
+
+	loop->listenfd = listenfd;
+	SYS(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, listenfd, &ev));
+}
+
 void
 server_request(struct server *sv, int connfd)
 {
-	if (sv->nr_threads == 0) { /* no worker threads */
-		do_server_request(sv, connfd);
-	} else {
-		/*  Save the relevant info in a buffer and have one of the
-		 *  worker threads do the work. */
+	server_requests(sv, &connfd, 1);
+}
 
-		pthread_mutex_lock(&sv->mutex);
-		while (((sv->request_head - sv->request_tail + sv->max_requests)
-			% sv->max_requests) == (sv->max_requests - 1)) {
-			/* buffer is full */
-			pthread_cond_wait(&sv->prod_cond, &sv->mutex);
+/* like server_request, for n connections at once. the workers are woken up
+ * once for all of them. */
+void
+server_requests(struct server *sv, int *connfds, int n)
+{
+	int i;
+
+	stats_get(sv)->connections += n;
+	for (i = 0; i < n; i++) {
+		if (sv->loops) {
+			loop_add(sv, connfds[i]);
+		} else if (sv->nr_threads == 0) {
+			do_server_conn(sv, conn_init(connfds[i], sv->keep_alive));
+		} else {
+			server_queue(sv, conn_init(connfds[i], sv->keep_alive));
 		}
-		/* fill conn_buf with this request */
-		assert(sv->conn_buf[sv->request_head] == -1);
-		sv->conn_buf[sv->request_head] = connfd;
-		sv->request_head = (sv->request_head + 1) % sv->max_requests;
-		pthread_cond_signal(&sv->cons_cond);
-		pthread_mutex_unlock(&sv->mutex);
+	}
+	if (!sv->loops && sv->nr_threads > 0 && n > 0) {
+		/* one worker for each connection, rather than all of them */
+		eventcount_notify(&sv->not_empty, n);
 	}
 }
 
@@ -406,41 +3736,50 @@ server_exit(struct server *sv)
 	 * these threads that the server is exiting. make sure to call
 	 * pthread_join in this function so that the main server thread waits
 	 * for all the worker threads to exit before exiting. */
-	pthread_mutex_lock(&sv->mutex);
-	sv->exiting = 1;
-	pthread_cond_broadcast(&sv->cons_cond);
-	pthread_mutex_unlock(&sv->mutex);
+	/* stop handing connections back to the workers first */
+	if (sv->idle) {
+		idle_stop(sv->idle);
+	}
+	for (i = 0; i < sv->nr_loops; i++) {
+		loop_stop(&sv->loops[i]);
+	}
+	/* workers finish the connections that are queued before exiting. no
+	 * worker is started or retired from now on. */
+	pthread_mutex_lock(&sv->pool_lock);
+	__atomic_store_n(&sv->exiting, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&sv->pool_lock);
+	eventcount_notify(&sv->not_empty, sv->nr_threads);
 	for (i = 0; i < sv->nr_threads; i++) {
-		pthread_join(sv->threads[i], NULL);
+		if (sv->workers[i].started) {
+			pthread_join(sv->workers[i].thread, NULL);
+		}
 	}
 
 	/* make sure to free any allocated resources */
-        struct node *free_cache = hash_brown -> LRU_cache;
-        struct node *temp = NULL;
-        while(free_cache != NULL){
-            temp = free_cache -> next;
-            file_data_free(free_cache -> file);
-            free(free_cache);
-            free_cache = temp;
-        }
-        
-        struct node *free_ht = NULL;
-        temp = NULL;
-        for(int i = 0; i < 20101; i++){
-            free_ht = hash_brown -> ht[0];
-            while(free_ht != NULL){
-                temp = free_ht -> next;
-                file_data_free(free_ht -> file);
-                free(free_ht);
-                free_ht = temp;
-            }
-        }
-        
-        pthread_mutex_destroy(hash_brown -> lock);
-        
-        free(hash_brown);
-        
-	free(sv->conn_buf);
-	free(sv->threads);
+	stats_print(sv);
+	if (sv->idle) {
+		idle_destroy(sv->idle);
+	}
+	for (i = 0; i < sv->nr_loops; i++) {
+		loop_destroy(&sv->loops[i]);
+	}
+	free(sv->loops);
+	if (sv->cache) {
+		cache_destroy(sv->cache);
+	}
+	if (sv->csums) {
+		csums_destroy(sv->csums);
+	}
+	if (sv->cpus) {
+		cpus_destroy(sv->cpus);
+	}
+	if (sv->sched) {
+		sched_destroy(sv->sched);
+	}
+	for (i = 0; i < sv->nr_threads; i++) {
+		queue_destroy(sv->workers[i].conns);
+	}
+	free(sv->workers);
+	request_pools_destroy();
 	free(sv);
 }
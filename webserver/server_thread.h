@@ -3,9 +3,31 @@
 
 struct server;
 
+/* optional server settings, set from the command line (see server.c) */
+struct server_opts {
+	int nr_shards;		/* nr of independently locked cache shards */
+	int lockfree;		/* cache hits don't take the shard lock */
+	char *policy;		/* cache replacement policy */
+	int admission;		/* TinyLFU filter in front of the cache */
+	int arena;		/* cache memory comes from a slab arena */
+	int zerocopy;		/* send uncached files with sendfile */
+	char *csums;		/* fileset index with the files' checksums */
+	int keep_alive;		/* idle timeout of persistent connections, s */
+	int event;		/* serve connections from epoll event loops */
+	int uring;		/* or from io_uring event loops */
+	int max_threads;	/* the pool of workers may grow this large */
+	char *cpus;		/* list of cpus to pin threads to, or NULL */
+	int partition;		/* each loop is a server of its own */
+	int target;		/* ms connections may queue before shedding */
+	char *sched;		/* order requests are served in, or NULL */
+};
+
 struct server *server_init(int nr_threads, int max_requests, 
-			   int max_cache_size);
+			   int max_cache_size, struct server_opts *opts);
 void server_request(struct server *sv, int connfd);
+void server_requests(struct server *sv, int *connfds, int n);
+int server_listeners(struct server *sv);
+void server_listen(struct server *sv, int listenfd);
 void server_exit(struct server *sv);
 
 #endif /* __SERVER_THREAD_H__ */
@@ -0,0 +1,423 @@
+/*
+ * slab.c: Arena allocator with size classes.
+ *
+ * The arena is mapped once and divided into pages. Runs of contiguous pages
+ * are handed out either as slabs, which are carved into equal chunks of one
+ * size class, or whole, for objects larger than the largest size class. Size
+ * classes grow geometrically by SLAB_FACTOR, so at most about 20% of a chunk
+ * is wasted, and objects in page runs waste less than a page.
+ *
+ * Each class keeps the slabs that have free chunks on a list, and each slab
+ * keeps its free chunks on a list threaded through the chunks themselves. A
+ * slab whose chunks have all been freed goes back to the pool of free pages
+ * right away, so memory moves between the size classes as the mix of object
+ * sizes shifts.
+ *
+ * Free pages are kept in maximal runs, which are merged with their neighbours
+ * when pages are given back, and listed by the log2 of their length, so that
+ * finding a run only looks at runs that may be long enough. The first page
+ * of a run has its length, and the last one points back to the first, so
+ * that a run can be found from either side.
+ *
+ * The pages' descriptors count against the size of the arena, so that the
+ * arena and its metadata together take no more than the size asked for.
+ */
+
+#include "common.h"
+#include "slab.h"
+
+#define SLAB_PAGE_SIZE 1024
+#define SLAB_MIN_CHUNK 64
+#define SLAB_MAX_CHUNK 1024
+#define SLAB_FACTOR 1.25
+/* a slab holds at least this many chunks, arena size permitting */
+#define SLAB_CHUNKS 8
+#define SLAB_MAX_CLASSES 32
+/* lists of free runs, by the log2 of their length */
+#define SLAB_RUN_LISTS 32
+
+/* page states, other than a size class */
+#define PAGE_FREE -1
+#define PAGE_LARGE -2
+
+/* one per page. only the first page of a run describes the run. */
+struct slab_page {
+	int cls;			/* class, PAGE_FREE or PAGE_LARGE */
+	int head;			/* index of the first page of the run */
+	int nr_pages;			/* pages in the run */
+	int nr_used;			/* chunks in use in a slab */
+	void *free_chunks;		/* free chunks in a slab */
+	struct slab_page *prev;		/* the class's slabs with free chunks, */
+	struct slab_page *next;		/* or the free runs of a length */
+};
+
+struct slab_class {
+	int chunk_size;
+	int slab_pages;			/* pages in each slab of this class */
+	struct slab_page *partial;	/* slabs with free chunks */
+};
+
+struct slab {
+	pthread_mutex_t lock;
+	char *base;
+	int nr_pages;
+	int nr_free_pages;
+	struct slab_page *free_runs[SLAB_RUN_LISTS];
+	struct slab_page *pages;
+	int nr_classes;
+	struct slab_class classes[SLAB_MAX_CLASSES];
+};
+
+static void slab_run_add(struct slab *sl, int first, int nr_pages);
+
+/* returns an arena that, with the descriptors of its pages, takes up to size
+ * bytes, see slab_capacity */
+struct slab *
+slab_init(size_t size)
+{
+	struct slab *sl;
+	int i, chunk_size;
+
+	sl = Malloc(sizeof(struct slab));
+	pthread_mutex_init(&sl->lock, NULL);
+	sl->nr_pages = size / (SLAB_PAGE_SIZE + sizeof(struct slab_page));
+	if (sl->nr_pages == 0) {
+		sl->nr_pages = 1;
+	}
+	sl->nr_free_pages = sl->nr_pages;
+	for (i = 0; i < SLAB_RUN_LISTS; i++) {
+		sl->free_runs[i] = NULL;
+	}
+	/* pages are only backed by memory once they are used */
+	sl->base = mmap(NULL, (size_t)sl->nr_pages * SLAB_PAGE_SIZE,
+			PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (sl->base == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	sl->pages = Malloc(sizeof(struct slab_page) * sl->nr_pages);
+	for (i = 0; i < sl->nr_pages; i++) {
+		sl->pages[i].cls = PAGE_FREE;
+		sl->pages[i].head = i;
+	}
+	slab_run_add(sl, 0, sl->nr_pages);
+
+	sl->nr_classes = 0;
+	for (chunk_size = SLAB_MIN_CHUNK; ; ) {
+		struct slab_class *cl = &sl->classes[sl->nr_classes++];
+		int pages;
+
+		assert(sl->nr_classes <= SLAB_MAX_CLASSES);
+		if (chunk_size > SLAB_MAX_CHUNK) {
+			chunk_size = SLAB_MAX_CHUNK;
+		}
+		pages = ((size_t)chunk_size * SLAB_CHUNKS + SLAB_PAGE_SIZE - 1) /
+			SLAB_PAGE_SIZE;
+		/* don't let one slab take over a small arena */
+		if (pages > sl->nr_pages / 8) {
+			pages = sl->nr_pages / 8;
+		}
+		if (pages * SLAB_PAGE_SIZE < chunk_size) {
+			pages = (chunk_size + SLAB_PAGE_SIZE - 1) /
+				SLAB_PAGE_SIZE;
+		}
+		cl->chunk_size = chunk_size;
+		cl->slab_pages = pages;
+		cl->partial = NULL;
+		if (chunk_size == SLAB_MAX_CHUNK)
+			break;
+		/* keep chunks 8-byte aligned */
+		chunk_size = ((int)(chunk_size * SLAB_FACTOR) + 7) & ~7;
+	}
+	return sl;
+}
+
+void
+slab_destroy(struct slab *sl)
+{
+	SYS(munmap(sl->base, (size_t)sl->nr_pages * SLAB_PAGE_SIZE));
+	free(sl->pages);
+	pthread_mutex_destroy(&sl->lock);
+	free(sl);
+}
+
+/* returns the smallest class for objects of this size, or -1 if the object
+ * needs a page run of its own */
+static int
+slab_class_of(struct slab *sl, size_t size)
+{
+	int i;
+
+	for (i = 0; i < sl->nr_classes; i++) {
+		if (size <= sl->classes[i].chunk_size)
+			return i;
+	}
+	return -1;
+}
+
+/* returns the list of free runs of nr_pages pages */
+static int
+slab_run_list(int nr_pages)
+{
+	int i = 0;
+
+	while ((nr_pages >>= 1) && i < SLAB_RUN_LISTS - 1)
+		i++;
+	return i;
+}
+
+/* the nr_pages pages from first on are a free run */
+static void
+slab_run_add(struct slab *sl, int first, int nr_pages)
+{
+	struct slab_page *pg = &sl->pages[first];
+	struct slab_page **list = &sl->free_runs[slab_run_list(nr_pages)];
+
+	pg->nr_pages = nr_pages;
+	pg->head = first;
+	sl->pages[first + nr_pages - 1].head = first;
+	pg->prev = NULL;
+	pg->next = *list;
+	if (*list) {
+		(*list)->prev = pg;
+	}
+	*list = pg;
+}
+
+static void
+slab_run_remove(struct slab *sl, struct slab_page *pg)
+{
+	if (pg->prev) {
+		pg->prev->next = pg->next;
+	} else {
+		sl->free_runs[slab_run_list(pg->nr_pages)] = pg->next;
+	}
+	if (pg->next) {
+		pg->next->prev = pg->prev;
+	}
+}
+
+/* returns the first page of a run of nr_pages free pages, or -1. the rest of
+ * the run it is taken from stays free. */
+static int
+slab_find_pages(struct slab *sl, int nr_pages)
+{
+	struct slab_page *run = NULL;
+	int i, first, len;
+
+	if (sl->nr_free_pages < nr_pages)
+		return -1;
+	/* only the runs on the first list may be too short */
+	for (i = slab_run_list(nr_pages); i < SLAB_RUN_LISTS && !run; i++) {
+		for (run = sl->free_runs[i]; run; run = run->next) {
+			if (run->nr_pages >= nr_pages)
+				break;
+		}
+	}
+	if (!run)
+		return -1;
+	first = run - sl->pages;
+	len = run->nr_pages;
+	slab_run_remove(sl, run);
+	if (len > nr_pages) {
+		slab_run_add(sl, first + nr_pages, len - nr_pages);
+	}
+	return first;
+}
+
+/* take a run of pages, and mark it as cls */
+static struct slab_page *
+slab_take_pages(struct slab *sl, int nr_pages, int cls)
+{
+	int first, i;
+	struct slab_page *pg;
+
+	first = slab_find_pages(sl, nr_pages);
+	if (first < 0)
+		return NULL;
+	for (i = first; i < first + nr_pages; i++) {
+		sl->pages[i].cls = cls;
+		sl->pages[i].head = first;
+	}
+	sl->nr_free_pages -= nr_pages;
+	pg = &sl->pages[first];
+	pg->nr_pages = nr_pages;
+	pg->nr_used = 0;
+	pg->free_chunks = NULL;
+	pg->prev = pg->next = NULL;
+	return pg;
+}
+
+/* give back the run of pages pg starts, merging it with the free runs on
+ * either side of it */
+static void
+slab_release_pages(struct slab *sl, struct slab_page *pg)
+{
+	int first = pg - sl->pages;
+	int nr_pages = pg->nr_pages;
+	int i, len = nr_pages;
+	struct slab_page *run;
+
+	for (i = first; i < first + nr_pages; i++) {
+		sl->pages[i].cls = PAGE_FREE;
+	}
+	/* a free page next to a taken one always starts or ends a run */
+	if (first + len < sl->nr_pages &&
+	    sl->pages[first + len].cls == PAGE_FREE) {
+		run = &sl->pages[first + len];
+		slab_run_remove(sl, run);
+		len += run->nr_pages;
+	}
+	if (first > 0 && sl->pages[first - 1].cls == PAGE_FREE) {
+		run = &sl->pages[sl->pages[first - 1].head];
+		slab_run_remove(sl, run);
+		len += run->nr_pages;
+		first = run - sl->pages;
+	}
+	slab_run_add(sl, first, len);
+	sl->nr_free_pages += nr_pages;
+}
+
+static char *
+slab_page_addr(struct slab *sl, struct slab_page *pg)
+{
+	return sl->base + (size_t)(pg - sl->pages) * SLAB_PAGE_SIZE;
+}
+
+static void
+slab_partial_add(struct slab_class *cl, struct slab_page *pg)
+{
+	pg->prev = NULL;
+	pg->next = cl->partial;
+	if (cl->partial) {
+		cl->partial->prev = pg;
+	}
+	cl->partial = pg;
+}
+
+static void
+slab_partial_remove(struct slab_class *cl, struct slab_page *pg)
+{
+	if (pg->prev) {
+		pg->prev->next = pg->next;
+	} else {
+		cl->partial = pg->next;
+	}
+	if (pg->next) {
+		pg->next->prev = pg->prev;
+	}
+	pg->prev = pg->next = NULL;
+}
+
+/* carve a new slab for the class into chunks */
+static struct slab_page *
+slab_grow(struct slab *sl, int cls)
+{
+	struct slab_class *cl = &sl->classes[cls];
+	struct slab_page *pg;
+	char *addr;
+	int i, nr_chunks;
+
+	pg = slab_take_pages(sl, cl->slab_pages, cls);
+	if (!pg)
+		return NULL;
+	addr = slab_page_addr(sl, pg);
+	nr_chunks = cl->slab_pages * SLAB_PAGE_SIZE / cl->chunk_size;
+	for (i = nr_chunks - 1; i >= 0; i--) {
+		void **chunk = (void **)(addr + (size_t)i * cl->chunk_size);
+
+		*chunk = pg->free_chunks;
+		pg->free_chunks = chunk;
+	}
+	slab_partial_add(cl, pg);
+	return pg;
+}
+
+void *
+slab_alloc(struct slab *sl, size_t size)
+{
+	struct slab_class *cl;
+	struct slab_page *pg;
+	void **chunk = NULL;
+	int cls;
+
+	pthread_mutex_lock(&sl->lock);
+	cls = slab_class_of(sl, size);
+	if (cls >= 0) {
+		cl = &sl->classes[cls];
+		pg = cl->partial;
+		if (!pg) {
+			pg = slab_grow(sl, cls);
+		}
+		if (pg) {
+			chunk = pg->free_chunks;
+			pg->free_chunks = *chunk;
+			pg->nr_used++;
+			if (!pg->free_chunks) {
+				slab_partial_remove(cl, pg);
+			}
+			goto out;
+		}
+		/* no room for a whole slab, but a run may still fit */
+	}
+	pg = slab_take_pages(sl, (size + SLAB_PAGE_SIZE - 1) / SLAB_PAGE_SIZE,
+			     PAGE_LARGE);
+	if (pg) {
+		chunk = (void **)slab_page_addr(sl, pg);
+	}
+out:
+	pthread_mutex_unlock(&sl->lock);
+	return chunk;
+}
+
+void
+slab_free(struct slab *sl, void *ptr)
+{
+	struct slab_page *pg;
+	struct slab_class *cl;
+	void **chunk = ptr;
+
+	pthread_mutex_lock(&sl->lock);
+	pg = &sl->pages[sl->pages[((char *)ptr - sl->base) /
+				  SLAB_PAGE_SIZE].head];
+	if (pg->cls == PAGE_LARGE) {
+		slab_release_pages(sl, pg);
+		goto out;
+	}
+	assert(pg->cls >= 0);
+	cl = &sl->classes[pg->cls];
+	if (!pg->free_chunks) {
+		/* the slab was full */
+		slab_partial_add(cl, pg);
+	}
+	*chunk = pg->free_chunks;
+	pg->free_chunks = chunk;
+	pg->nr_used--;
+	if (pg->nr_used == 0) {
+		/* give the whole slab back, for any class to use */
+		slab_partial_remove(cl, pg);
+		slab_release_pages(sl, pg);
+	}
+out:
+	pthread_mutex_unlock(&sl->lock);
+}
+
+/* returns the bytes that can be allocated from the arena, at most */
+size_t
+slab_capacity(struct slab *sl)
+{
+	return (size_t)sl->nr_pages * SLAB_PAGE_SIZE;
+}
+
+/* returns the bytes of the arena used by an object of this size, when it is
+ * allocated from a slab of its class */
+size_t
+slab_size(struct slab *sl, size_t size)
+{
+	int cls = slab_class_of(sl, size);
+
+	if (cls >= 0)
+		return sl->classes[cls].chunk_size;
+	return (size + SLAB_PAGE_SIZE - 1) / SLAB_PAGE_SIZE * SLAB_PAGE_SIZE;
+}
@@ -0,0 +1,22 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stddef.h>
+
+/*
+ * A fixed-size memory arena, reserved up front, from which objects are
+ * allocated in size classes. slab_alloc() returns NULL when the arena is full,
+ * so that the caller can free other objects and try again. All functions may
+ * be called concurrently.
+ */
+
+struct slab;
+
+struct slab *slab_init(size_t size);
+void slab_destroy(struct slab *sl);
+void *slab_alloc(struct slab *sl, size_t size);
+void slab_free(struct slab *sl, void *ptr);
+size_t slab_size(struct slab *sl, size_t size);
+size_t slab_capacity(struct slab *sl);
+
+#endif /* __SLAB_H__ */
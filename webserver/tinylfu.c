@@ -0,0 +1,214 @@
+/*
+ * tinylfu.c: Frequency sketch for cache admission (TinyLFU).
+ *
+ * Accesses are counted in a count-min sketch of 4-bit counters, 4 rows deep.
+ * The first access to an item only sets it in the doorkeeper, a Bloom filter,
+ * so that the many items that are accessed once never reach the sketch. After
+ * every SAMPLE_FACTOR * width accesses, all counters are halved and the
+ * doorkeeper is cleared, so that the sketch reflects recent popularity.
+ *
+ * The counters are packed two to a byte. A counter is updated with a
+ * compare-and-swap on its byte, so that its neighbour isn't clobbered, and an
+ * update that loses a race for the same counter is dropped.
+ */
+
+#include "common.h"
+#include "tinylfu.h"
+
+#define SKETCH_DEPTH 4
+#define COUNTER_MAX 15
+#define SAMPLE_FACTOR 10
+/* doorkeeper bits per sketch counter */
+#define DOORKEEPER_BITS 8
+
+struct tinylfu {
+	int width;			/* counters per row, a power of 2 */
+	unsigned char *counters;	/* SKETCH_DEPTH rows of width nibbles */
+	unsigned long *doorkeeper;	/* bitmap of width * DOORKEEPER_BITS */
+	long samples;			/* accesses since the last aging */
+	long sample_size;
+};
+
+/* returns a sketch for a cache that holds about nr_items items */
+struct tinylfu *
+tinylfu_init(int nr_items)
+{
+	struct tinylfu *tl;
+
+	tl = Malloc(sizeof(struct tinylfu));
+	tl->width = 64;
+	while (tl->width < nr_items) {
+		tl->width <<= 1;
+	}
+	tl->counters = Malloc(SKETCH_DEPTH * tl->width / 2);
+	memset(tl->counters, 0, SKETCH_DEPTH * tl->width / 2);
+	tl->doorkeeper = Malloc(tl->width * DOORKEEPER_BITS / 8);
+	memset(tl->doorkeeper, 0, tl->width * DOORKEEPER_BITS / 8);
+	tl->samples = 0;
+	tl->sample_size = (long)SAMPLE_FACTOR * tl->width;
+	return tl;
+}
+
+void
+tinylfu_destroy(struct tinylfu *tl)
+{
+	free(tl->counters);
+	free(tl->doorkeeper);
+	free(tl);
+}
+
+/* spread the bits of the hash, so that each row and the doorkeeper can use
+ * their own slice of it */
+static unsigned long
+tinylfu_mix(unsigned long hash)
+{
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdUL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53UL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+/* returns the index of the counter for the item in row */
+static int
+tinylfu_counter(struct tinylfu *tl, unsigned long mixed, int row)
+{
+	int i = (mixed >> (row * 16)) & (tl->width - 1);
+
+	return row * tl->width + i;
+}
+
+static int
+tinylfu_counter_get(struct tinylfu *tl, int i)
+{
+	unsigned char b = __atomic_load_n(&tl->counters[i / 2],
+					  __ATOMIC_RELAXED);
+
+	return (b >> ((i & 1) * 4)) & 0xf;
+}
+
+/* set counter i to val, unless it is no longer old */
+static void
+tinylfu_counter_set(struct tinylfu *tl, int i, int old, int val)
+{
+	unsigned char *p = &tl->counters[i / 2];
+	int shift = (i & 1) * 4;
+	unsigned char b, nb;
+
+	b = __atomic_load_n(p, __ATOMIC_RELAXED);
+	do {
+		if (((b >> shift) & 0xf) != old)
+			return;
+		nb = (b & ~(0xf << shift)) | (val << shift);
+	} while (!__atomic_compare_exchange_n(p, &b, nb, 1, __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+}
+
+/* the doorkeeper uses two bits, taken from the hash before mixing */
+static int
+tinylfu_doorkeeper_bit(struct tinylfu *tl, unsigned long hash, int k)
+{
+	int nr_bits = tl->width * DOORKEEPER_BITS;
+
+	return (k ? (hash >> 32) : hash) & (nr_bits - 1);
+}
+
+static int
+tinylfu_doorkeeper_test(struct tinylfu *tl, unsigned long hash)
+{
+	int k;
+
+	for (k = 0; k < 2; k++) {
+		int bit = tinylfu_doorkeeper_bit(tl, hash, k);
+		unsigned long word;
+
+		word = __atomic_load_n(&tl->doorkeeper[bit / 64],
+				       __ATOMIC_RELAXED);
+		if (!(word & (1UL << (bit % 64))))
+			return 0;
+	}
+	return 1;
+}
+
+static void
+tinylfu_doorkeeper_set(struct tinylfu *tl, unsigned long hash)
+{
+	int k;
+
+	for (k = 0; k < 2; k++) {
+		int bit = tinylfu_doorkeeper_bit(tl, hash, k);
+
+		__atomic_fetch_or(&tl->doorkeeper[bit / 64], 1UL << (bit % 64),
+				  __ATOMIC_RELAXED);
+	}
+}
+
+/* halve all counters and clear the doorkeeper */
+static void
+tinylfu_age(struct tinylfu *tl)
+{
+	int i;
+
+	/* both counters in a byte at once */
+	for (i = 0; i < SKETCH_DEPTH * tl->width / 2; i++) {
+		unsigned char c = __atomic_load_n(&tl->counters[i],
+						  __ATOMIC_RELAXED);
+		__atomic_store_n(&tl->counters[i], (c >> 1) & 0x77,
+				 __ATOMIC_RELAXED);
+	}
+	for (i = 0; i < tl->width * DOORKEEPER_BITS / 64; i++) {
+		__atomic_store_n(&tl->doorkeeper[i], 0, __ATOMIC_RELAXED);
+	}
+}
+
+/* count an access to the item with this hash */
+void
+tinylfu_record(struct tinylfu *tl, unsigned long hash)
+{
+	unsigned long mixed;
+	int c[SKETCH_DEPTH];
+	int min = COUNTER_MAX;
+	int row;
+
+	if (__atomic_add_fetch(&tl->samples, 1, __ATOMIC_RELAXED) ==
+	    tl->sample_size) {
+		tinylfu_age(tl);
+		__atomic_store_n(&tl->samples, 0, __ATOMIC_RELAXED);
+	}
+	if (!tinylfu_doorkeeper_test(tl, hash)) {
+		tinylfu_doorkeeper_set(tl, hash);
+		return;
+	}
+	/* conservative update: only increment the smallest counters */
+	mixed = tinylfu_mix(hash);
+	for (row = 0; row < SKETCH_DEPTH; row++) {
+		int v;
+
+		c[row] = tinylfu_counter(tl, mixed, row);
+		v = tinylfu_counter_get(tl, c[row]);
+		if (v < min)
+			min = v;
+	}
+	if (min == COUNTER_MAX)
+		return;
+	for (row = 0; row < SKETCH_DEPTH; row++) {
+		tinylfu_counter_set(tl, c[row], min, min + 1);
+	}
+}
+
+/* returns the estimated number of recent accesses to the item */
+int
+tinylfu_estimate(struct tinylfu *tl, unsigned long hash)
+{
+	unsigned long mixed = tinylfu_mix(hash);
+	int row, min = COUNTER_MAX;
+
+	for (row = 0; row < SKETCH_DEPTH; row++) {
+		int c = tinylfu_counter_get(tl, tinylfu_counter(tl, mixed,
+								 row));
+		if (c < min)
+			min = c;
+	}
+	return min + tinylfu_doorkeeper_test(tl, hash);
+}
@@ -0,0 +1,21 @@
+#ifndef __TINYLFU_H__
+#define __TINYLFU_H__
+
+/*
+ * TinyLFU: an approximate, aging frequency histogram of recent accesses,
+ * used to decide whether a new file is worth caching in place of the file
+ * the cache would evict for it.
+ *
+ * tinylfu_record() and tinylfu_estimate() may be called concurrently without
+ * locking. Concurrent updates may be lost, which only makes the estimates
+ * slightly less accurate.
+ */
+
+struct tinylfu;
+
+struct tinylfu *tinylfu_init(int nr_items);
+void tinylfu_destroy(struct tinylfu *tl);
+void tinylfu_record(struct tinylfu *tl, unsigned long hash);
+int tinylfu_estimate(struct tinylfu *tl, unsigned long hash);
+
+#endif /* __TINYLFU_H__ */
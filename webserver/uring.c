@@ -0,0 +1,247 @@
+/*
+ * uring.c: io_uring without liburing.
+ *
+ * The submission and completion rings are shared with the kernel through
+ * mappings of the ring fd. Entries are queued at a private tail, which is
+ * published to the kernel in uring_enter(), so that many operations go in with
+ * one system call. Completions are consumed in place, and handed back to the
+ * kernel by advancing the completion head.
+ */
+
+#include "common.h"
+#include "uring.h"
+#include <sys/syscall.h>
+
+struct uring {
+	int fd;
+	unsigned int sq_entries;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int sqe_tail;		/* queued, not yet published */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *ring;			/* both rings, mapped at once */
+	size_t ring_size;
+	size_t sqes_size;
+	long nr_enters;			/* system calls, for stats */
+};
+
+/* the operations the server queues. multishot accept came in 5.19, together
+ * with IORING_OP_SOCKET, which stands in for it since multishot is a flag and
+ * can't be probed. openat and close into fixed file slots came in 5.15. */
+static const int uring_ops[] = {
+	IORING_OP_POLL_ADD, IORING_OP_ACCEPT, IORING_OP_RECV,
+	IORING_OP_READ_FIXED, IORING_OP_SENDMSG, IORING_OP_SPLICE,
+	IORING_OP_OPENAT, IORING_OP_FADVISE, IORING_OP_READ, IORING_OP_CLOSE,
+	IORING_OP_SOCKET,
+};
+
+/* returns 1 if the kernel behind ring fd supports all of uring_ops */
+static int
+uring_probe(int fd)
+{
+	struct io_uring_probe *probe;
+	size_t size;
+	int ret = 1, i, op;
+
+	size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	probe = Malloc(size);
+	memset(probe, 0, size);
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+		    256) < 0) {
+		free(probe);
+		return 0;
+	}
+	for (i = 0; i < sizeof(uring_ops) / sizeof(uring_ops[0]); i++) {
+		op = uring_ops[i];
+		if (op > probe->last_op ||
+		    !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+			ret = 0;
+			break;
+		}
+	}
+	free(probe);
+	return ret;
+}
+
+/* returns a ring with room for entries submissions, or NULL if io_uring can't
+ * be used */
+struct uring *
+uring_init(unsigned int entries)
+{
+	struct io_uring_params p;
+	struct uring *ur;
+	size_t sq_size, cq_size;
+	char *ring;
+
+	memset(&p, 0, sizeof(p));
+	ur = Malloc(sizeof(struct uring));
+	ur->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ur->fd < 0) {
+		free(ur);
+		return NULL;
+	}
+	/* older kernels map the rings separately, can't wait with a timeout,
+	 * or lack some of the operations */
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p.features & IORING_FEAT_EXT_ARG) || !uring_probe(ur->fd)) {
+		SYS(close(ur->fd));
+		free(ur);
+		return NULL;
+	}
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ur->ring_size = sq_size > cq_size ? sq_size : cq_size;
+	ring = mmap(NULL, ur->ring_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+	ur->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ur->sqes = mmap(NULL, ur->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+	if (ring == MAP_FAILED || ur->sqes == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	ur->ring = ring;
+	ur->sq_entries = p.sq_entries;
+	ur->sq_head = (unsigned int *)(ring + p.sq_off.head);
+	ur->sq_tail = (unsigned int *)(ring + p.sq_off.tail);
+	ur->sq_mask = (unsigned int *)(ring + p.sq_off.ring_mask);
+	ur->sq_array = (unsigned int *)(ring + p.sq_off.array);
+	ur->sqe_tail = *ur->sq_tail;
+	ur->cq_head = (unsigned int *)(ring + p.cq_off.head);
+	ur->cq_tail = (unsigned int *)(ring + p.cq_off.tail);
+	ur->cq_mask = (unsigned int *)(ring + p.cq_off.ring_mask);
+	ur->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+	ur->nr_enters = 0;
+	return ur;
+}
+
+/* operations that are still running are cancelled */
+void
+uring_destroy(struct uring *ur)
+{
+	SYS(munmap(ur->sqes, ur->sqes_size));
+	SYS(munmap(ur->ring, ur->ring_size));
+	SYS(close(ur->fd));
+	free(ur);
+}
+
+/* queue an operation, and return its entry for the caller to finish. the
+ * queue is submitted first if it is full. */
+struct io_uring_sqe *
+uring_prep(struct uring *ur, int op, int fd, const void *addr,
+	   unsigned int len, unsigned long long off,
+	   unsigned long long user_data)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int i;
+
+	if (ur->sqe_tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE) ==
+	    ur->sq_entries) {
+		uring_enter(ur, 0, -1);
+	}
+	i = ur->sqe_tail & *ur->sq_mask;
+	sqe = &ur->sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)addr;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = user_data;
+	ur->sq_array[i] = i;
+	ur->sqe_tail++;
+	return sqe;
+}
+
+/* submit the queued operations, and wait until there are wait_nr completions,
+ * or for at most timeout ms unless timeout is -1. returns the number of
+ * operations submitted. */
+int
+uring_enter(struct uring *ur, unsigned int wait_nr, int timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int flags = 0;
+	unsigned int to_submit;
+	int ret;
+
+	to_submit = ur->sqe_tail - *ur->sq_tail;
+	__atomic_store_n(ur->sq_tail, ur->sqe_tail, __ATOMIC_RELEASE);
+	memset(&arg, 0, sizeof(arg));
+	if (wait_nr > 0) {
+		flags |= IORING_ENTER_GETEVENTS;
+	}
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000L;
+		arg.ts = (unsigned long)&ts;
+		flags |= IORING_ENTER_EXT_ARG;
+	}
+	ur->nr_enters++;
+	ret = syscall(__NR_io_uring_enter, ur->fd, to_submit, wait_nr, flags,
+		      timeout >= 0 ? (void *)&arg : NULL,
+		      timeout >= 0 ? sizeof(arg) : 0);
+	if (ret < 0) {
+		if (errno == ETIME || errno == EINTR)
+			return 0;
+		perror("io_uring_enter");
+		exit(1);
+	}
+	return ret;
+}
+
+/* returns the oldest completion, or NULL */
+struct io_uring_cqe *
+uring_peek(struct uring *ur)
+{
+	unsigned int head = *ur->cq_head;
+
+	if (head == __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &ur->cqes[head & *ur->cq_mask];
+}
+
+/* the completion returned by uring_peek has been handled */
+void
+uring_seen(struct uring *ur)
+{
+	__atomic_store_n(ur->cq_head, *ur->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* register buf as fixed buffer 0, for IORING_OP_READ_FIXED. returns -1 if the
+ * kernel refuses, e.g. because of the locked memory limit. */
+int
+uring_register_buffer(struct uring *ur, void *buf, size_t len)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+	return syscall(__NR_io_uring_register, ur->fd,
+		       IORING_REGISTER_BUFFERS, &iov, 1);
+}
+
+/* register a table of nr_files empty fixed file slots, which operations can
+ * open files into. returns -1 on failure. */
+int
+uring_register_files(struct uring *ur, int nr_files)
+{
+	int fds[nr_files];
+	int i;
+
+	for (i = 0; i < nr_files; i++) {
+		fds[i] = -1;
+	}
+	return syscall(__NR_io_uring_register, ur->fd, IORING_REGISTER_FILES,
+		       fds, nr_files);
+}
+
+long
+uring_nr_enters(struct uring *ur)
+{
+	return ur->nr_enters;
+}
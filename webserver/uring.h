@@ -0,0 +1,31 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/*
+ * A thin io_uring wrapper on top of the raw system calls. Operations are
+ * queued with uring_prep(), which returns the submission entry so that the
+ * caller can fill in the fields specific to the operation, and are submitted
+ * by uring_enter(), which can also wait for completions. uring_init() returns
+ * NULL when the kernel doesn't support io_uring, so that callers can fall back
+ * to plain system calls. A ring must only be used by one thread at a time.
+ */
+
+struct uring;
+
+struct uring *uring_init(unsigned int entries);
+void uring_destroy(struct uring *ur);
+struct io_uring_sqe *uring_prep(struct uring *ur, int op, int fd,
+				const void *addr, unsigned int len,
+				unsigned long long off,
+				unsigned long long user_data);
+int uring_enter(struct uring *ur, unsigned int wait_nr, int timeout);
+struct io_uring_cqe *uring_peek(struct uring *ur);
+void uring_seen(struct uring *ur);
+int uring_register_buffer(struct uring *ur, void *buf, size_t len);
+int uring_register_files(struct uring *ur, int nr_files);
+long uring_nr_enters(struct uring *ur);
+
+#endif /* __URING_H__ */